@@ -0,0 +1,3807 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "allocator.h"
+
+// Alignment for memory addresses (8 bytes for 64-bit systems). Build with
+// -DALIGNMENT=16 to match the glibc ABI, which guarantees 16 on x86-64.
+#ifndef ALIGNMENT
+#define ALIGNMENT 8
+#endif
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
+
+// Block metadata structure. Only the header word is kept for every block:
+// the payload size, with two flags in the low bits (sizes are aligned, so
+// those are always zero). The free-list links exist only while the block is
+// free, so they overlay the first bytes of the payload. Hardened builds put
+// a canary word in front of the header (see Hardening).
+typedef struct block {
+#ifdef HARDENED
+    size_t canary;            // Checksum of the block's address and size
+#endif
+    size_t header;            // Size of usable memory | BLOCK_FREE | BLOCK_PREV_INUSE
+    struct block *next_free;  // Next block in the same size-class bin (free blocks only)
+    struct block *prev_free;  // Previous block in the same size-class bin (free blocks only)
+} block_t;
+
+#define BLOCK_FREE       1    // This block is free
+#define BLOCK_PREV_INUSE 2    // The physically previous block is in use
+#define BLOCK_SAMPLED    4    // Recorded by the heap profiler (see Heap Profiling)
+#define BLOCK_FLAGS      (ALIGNMENT - 1)
+
+// Per-block overhead: the payload starts right after the header word
+// (padded out to ALIGNMENT when that is bigger than a word, and after the
+// canary in a hardened build)
+#define BLOCK_SIZE ALIGN(offsetof(block_t, next_free))
+
+// Boundary tag stored in the last word of a free block's payload: the block
+// size. Together with BLOCK_PREV_INUSE in the next header it lets a block
+// find its free physical predecessor without a list walk; used blocks need
+// no tag, because nobody looks for them.
+typedef size_t tag_t;
+#define TAG_SIZE sizeof(tag_t)
+
+// Smallest payload a block can have: room for the links and the tag once
+// it is freed, rounded to keep block sizes aligned
+#define MIN_PAYLOAD ALIGN(sizeof(block_t) - BLOCK_SIZE + TAG_SIZE)
+
+// All memory comes from the OS in mappings aligned to CHUNK_SIZE, each
+// starting with a chunk_t. Masking any pointer the allocator handed out
+// with CHUNK_MASK therefore finds its chunk header, which says what kind of
+// memory it is and which arena owns it. Arenas grow in chunks of exactly
+// CHUNK_SIZE bytes holding either blocks or slabs:
+//   [chunk_t][block][block]...[epilogue header]
+//   [chunk_t ... (first page)][slab][slab]...[slab]
+// The first block's BLOCK_PREV_INUSE is always set and the zero-sized
+// epilogue is permanently "used", so coalescing never has to check whether
+// a neighbour lies outside the chunk.
+#define CHUNK_SIZE  (1024 * 1024)
+#define CHUNK_MASK  (~(uintptr_t)(CHUNK_SIZE - 1))
+
+// Slabs are page-sized runs of equal slots for one small size class (see
+// Slabs); objects in them carry no header at all
+#define SLAB_SIZE         4096
+#define SLAB_MASK         (~(uintptr_t)(SLAB_SIZE - 1))
+#define SLAB_MAX_SIZE     256
+#define NUM_SLAB_CLASSES  (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_BITMAP_WORDS ((SLAB_SIZE / ALIGNMENT + 63) / 64)
+#define CHUNK_PAGES       (CHUNK_SIZE / SLAB_SIZE)
+
+enum { CHUNK_BLOCKS, CHUNK_SLABS, CHUNK_DIRECT, CHUNK_GUARDED, CHUNK_QUARANTINED, CHUNK_SPARE };
+
+// Arena chunks can be mapped in pairs, as one region backed by a 2 MiB huge
+// page (see Huge Pages)
+#define HUGE_PAGE_SIZE (2 * CHUNK_SIZE)
+
+enum { HUGE_NONE, HUGE_THP, HUGE_TLB };
+
+struct heap;
+
+typedef struct chunk {
+    int kind;                  // CHUNK_BLOCKS, CHUNK_SLABS, CHUNK_DIRECT, CHUNK_SPARE or (hardened,
+                               // see Guarded Allocations) CHUNK_GUARDED/CHUNK_QUARANTINED
+    int huge;                  // Arena: HUGE_THP or HUGE_TLB in a huge-page region, else HUGE_NONE
+    struct heap *heap;         // Owning arena (NULL for a direct or guarded mapping)
+    struct chunk *next;        // Next chunk of the same arena and kind
+    struct chunk *prev;        // Direct: previous live direct mapping
+    block_t *epilogue;         // Blocks: zero-sized terminator at the end of the chunk
+    char *untouched;           // Blocks: no block past here was handed out yet (see my_calloc);
+                               // spare: no byte past here is dirty
+    block_t *block;            // Direct and guarded: the mapping's only block
+    size_t map_size;           // Direct and guarded: length of the whole mapping
+    unsigned int slabs_used;   // Slabs: pages currently handed out as slabs
+    uint64_t free_pages[CHUNK_PAGES / 64];  // Slabs: bit i set = page i unused
+} chunk_t;
+
+#define CHUNK_HEADER_SIZE ALIGN(sizeof(chunk_t))
+#define CHUNK_OVERHEAD    (CHUNK_HEADER_SIZE + BLOCK_SIZE + BLOCK_SIZE)
+// Largest block a chunk can hold; bigger requests are always mapped directly
+#define MAX_CHUNK_BLOCK (CHUNK_SIZE - CHUNK_OVERHEAD)
+
+// Requests of at least mmap_threshold bytes bypass the arenas and get a
+// mapping of their own (see Direct Mappings)
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+// Header of one slab page
+typedef struct slab {
+    struct slab *next;         // Other slabs of the class that have free slots
+    struct slab *prev;
+    unsigned int obj_size;     // Slot size
+    unsigned int capacity;     // Number of slots
+    unsigned int used;         // Slots handed out
+    uint64_t bitmap[SLAB_BITMAP_WORDS];  // Bit i set = slot i free
+} slab_t;
+
+#define SLAB_HEADER_SIZE ALIGN(sizeof(slab_t))
+
+// A freed object waiting in a thread cache or a remote queue is linked
+// through its first word, which works the same for blocks and slab slots
+typedef struct free_node {
+    struct free_node *next;
+} free_node_t;
+
+// Free blocks of at least PURGE_MIN_SIZE bytes remember when they were freed
+// (see Purging); pages they have been holding for purge_decay_ms are handed
+// back to the kernel
+#define PURGE_MIN_SIZE       (16 * 1024)
+#define DEFAULT_DECAY_MS     1000
+#define PURGE_CHECK_INTERVAL 64    // heap_free calls between clock checks
+
+// Freed blocks of up to FASTBIN_MAX_SIZE bytes can wait in a fastbin
+// instead of being merged right away (see Deferred Coalescing)
+#define FASTBIN_MAX_SIZE 2048
+#define NUM_FASTBINS     (FASTBIN_MAX_SIZE / ALIGNMENT)
+
+// ========== Size Classes ==========
+// Requests up to SMALL_BIN_MAX get one exact bin per ALIGNMENT step, so the
+// first block in a small bin always fits. Larger sizes are binned TLSF-style
+// in two levels: a power-of-two class [2^k, 2^(k+1)), split linearly into
+// LARGE_SPLITS bins of equal width. Each level has a bitmap of non-empty
+// entries, so the first non-empty bin at or after any index is found with
+// two count-trailing-zeros, however many blocks are free.
+#define SMALL_BIN_MAX     512
+#define SMALL_BIN_SHIFT   9      // log2(SMALL_BIN_MAX)
+#define NUM_SMALL_BINS    (SMALL_BIN_MAX / ALIGNMENT)
+#define LARGE_SPLIT_SHIFT 4
+#define LARGE_SPLITS      (1 << LARGE_SPLIT_SHIFT)
+#define LARGE_SHIFT_MAX   20     // log2(CHUNK_SIZE): binned blocks are smaller than a chunk
+#define NUM_LARGE_CLASSES (LARGE_SHIFT_MAX - SMALL_BIN_SHIFT)
+#define NUM_BINS          (NUM_SMALL_BINS + NUM_LARGE_CLASSES * LARGE_SPLITS)
+
+// ========== Arenas ==========
+// Each arena is an independent heap with its own lock, bins and chunks.
+// Threads are bound to one arena, so threads on different arenas never
+// contend for a lock or share a cache line of block headers.
+#define MAX_ARENAS 64
+#define CACHE_LINE 64
+
+// Arenas are spread over the NUMA nodes (see Arena Binding); nodes are
+// numbered below this, so one word is a node mask
+#define MAX_NUMA_NODES 64
+
+// Back-end counters (see Statistics), updated under the arena lock
+typedef struct heap_stats {
+    size_t chunks;             // Block chunks mapped
+    size_t slab_chunks;        // Slab chunks mapped
+    size_t free_bytes;         // In binned free blocks, headers included
+    size_t slab_bytes;         // In slab slots handed out
+    size_t fast_bytes;         // In blocks parked in fastbins, headers included
+    size_t spare_chunks;       // Unused halves of huge-page regions
+    size_t huge_chunks;        // Chunks in huge-page regions, spares included
+    uint64_t request_space;    // request_space calls
+    uint64_t splits;
+    uint64_t coalesces;
+    uint64_t consolidations;   // heap_consolidate passes
+    uint64_t remote_frees;     // Objects drained from the remote-free queue
+    uint64_t lock_acquired;    // Lock Profiling: times the arena lock was taken
+    uint64_t lock_contended;   // ... of which it was held by another thread
+    uint64_t lock_wait_ns;     // Time spent waiting for it
+    uint64_t lock_hold_ns;     // Time it was held, estimated from a sample
+    size_t free_blocks[MALLOC_STAT_CLASSES];  // Binned free blocks by stat_class
+} heap_stats_t;
+
+typedef struct heap {
+    pthread_mutex_t lock;
+    unsigned int index;               // Position in heaps[]
+    unsigned int node;                // NUMA node it belongs to
+    chunk_t *chunks;                  // Block chunks in creation order
+    chunk_t *last_chunk;
+    chunk_t *slab_chunks;             // Slab chunks, newest first
+    chunk_t *spare_chunks;            // Mapped halves of huge-page regions not in use
+    slab_t *slabs[NUM_SLAB_CLASSES];  // Slabs with free slots, one list per class
+    block_t *bins[NUM_BINS];          // Free blocks only, one doubly-linked list per size class
+    uint64_t small_map;               // Bit i is set when small bin i is non-empty
+    uint32_t class_map;               // Bit c is set when any bin of large class c is non-empty
+    uint32_t split_map[NUM_LARGE_CLASSES];  // Bit j: bin j of large class c is non-empty
+    uint64_t last_purge_ms;           // When the decay purger last ran
+    unsigned int purge_ticks;         // heap_free calls since the last clock check
+    uint64_t lock_since;              // When a sampled hold of the lock began (0 = none)
+    heap_stats_t stats;
+    block_t *fastbins[NUM_FASTBINS];  // Unmerged freed blocks, one singly-linked list per size
+    block_t *rover;                   // Next fit: where the last search left off (binned, or NULL)
+
+    // Objects freed by threads of other arenas, waiting for the owner (see
+    // Remote Frees). Producers only touch remote_head, which gets its own
+    // cache line so they don't bounce the one holding the lock and bins.
+    free_node_t *remote_tail;         // Oldest queued object (owner only, under lock)
+    free_node_t remote_stub;          // Placeholder node that keeps the queue non-empty
+    _Alignas(CACHE_LINE) free_node_t *_Atomic remote_head;  // Newest queued object
+} __attribute__((aligned(CACHE_LINE))) heap_t;
+
+static heap_t heaps[MAX_ARENAS];
+static unsigned int heap_count;
+static unsigned int numa_nodes = 1;
+static pthread_once_t heaps_once = PTHREAD_ONCE_INIT;
+
+static void heaps_init(void);
+
+static _Atomic arena_policy_t arena_policy = ARENA_ROUND_ROBIN;
+static atomic_uint next_arena;
+
+static _Atomic size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+static _Atomic long purge_decay_ms = DEFAULT_DECAY_MS;
+static _Atomic size_t fastbin_limit;  // 0 = merge on every free
+static _Atomic int huge_pages;        // Map arena chunks in huge-page regions
+
+// Building with -DFIRST_FIT only changes the strategy the heap starts with
+#ifdef FIRST_FIT
+static _Atomic fit_strategy_t fit_strategy = FIT_FIRST;
+#else
+static _Atomic fit_strategy_t fit_strategy = FIT_BEST;
+#endif
+
+// MADV_FREE is lazier (the kernel only reclaims under pressure) but needs
+// Linux 4.5; fall back to MADV_DONTNEED the first time it is refused
+#ifdef MADV_FREE
+static _Atomic int lazy_advice = MADV_FREE;
+#else
+static _Atomic int lazy_advice = MADV_DONTNEED;
+#endif
+
+// Live direct mappings, and their totals for the statistics
+static chunk_t *direct_chunks;
+static size_t direct_count;
+static size_t direct_mapped;      // Bytes mapped
+static size_t direct_allocated;   // Bytes usable
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the list of thread caches, whose call counters my_malloc_stats sums
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the heap profiler's tables (see Heap Profiling)
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Thread-local state uses the initial-exec TLS model: with the default model
+// a shared library's first access can go through __tls_get_addr, which may
+// call malloc, i.e. us (see preload.c)
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+// Arena the calling thread allocates from (NULL until its first allocation)
+static THREAD_LOCAL heap_t *thread_heap;
+// Was that arena on the node the thread ran on when it last picked one?
+static THREAD_LOCAL int thread_node_local;
+
+// ========== Hardening ==========
+// Built with -DHARDENED, the allocator checks its own metadata wherever a
+// bug in the program would otherwise corrupt it silently and crash
+// somewhere else much later:
+// - Every block has a canary in front of its header: a checksum of the
+//   block's address and size, keyed by a per-process secret. It is checked
+//   before a block is freed or reallocated and before coalescing trusts a
+//   neighbour's header, so an overflow into the next block is caught.
+// - Freeing an object that is already free (binned, back in its slab or
+//   parked in a thread cache) is reported instead of linking it in twice.
+// - Unlinking a free block checks that its bin neighbours point back at it,
+//   and thread-cache links are stored XOR-masked with the secret and their
+//   own address, so an overwritten link is either caught or useless.
+// - A random sample of allocations can go to guarded mappings instead (see
+//   Guarded Allocations), which fault on an overflow or a use after free.
+// Each check is a few instructions on memory the allocator touches anyway.
+// A failed one prints what it found on stderr and aborts. Without HARDENED
+// it all compiles away.
+#ifdef HARDENED
+// Every request is at least two words, so a cached object has room for its
+// link and the cache key
+#define MIN_OBJECT (2 * sizeof(void*))
+
+static uintptr_t heap_secret;  // Keys block canaries and thread-cache links
+static uintptr_t cache_key;    // Marks objects parked in a thread cache
+static uintptr_t fast_key;     // Marks blocks parked in a fastbin
+
+// Pick the secrets, before the first block is carved (see heaps_init)
+static void hardening_init(void) {
+    uintptr_t random[3];
+    if (getrandom(random, sizeof(random), GRND_NONBLOCK) != sizeof(random)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        random[0] = ((uintptr_t)ts.tv_nsec << 32) ^ (uintptr_t)ts.tv_sec ^ (uintptr_t)&ts;
+        random[1] = random[0] * 0x9e3779b97f4a7c15ULL ^ (uintptr_t)getpid();
+        random[2] = random[1] * 0x9e3779b97f4a7c15ULL ^ (uintptr_t)ts.tv_nsec;
+    }
+    heap_secret = random[0];
+    cache_key = random[1] | 1;  // Never zero, the value a handed-out object is cleared to
+    fast_key = (random[2] | 1) == cache_key ? cache_key ^ 2 : random[2] | 1;
+}
+
+// Report heap corruption and abort; writes straight to stderr, since the
+// heap can't be trusted to run stdio any more
+__attribute__((noreturn, cold))
+static void heap_corrupted(const char *what, void *ptr) {
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "my_malloc: %s at %p\n", what, ptr);
+    if (len > 0) {
+        ssize_t written = write(STDERR_FILENO, msg, (size_t)len < sizeof(msg) ? (size_t)len : sizeof(msg) - 1);
+        (void)written;
+    }
+    abort();
+}
+
+static size_t block_canary(block_t *block) {
+    size_t size = block->header & ~(size_t)BLOCK_FLAGS;
+    return ((uintptr_t)block ^ size) * 0x9e3779b97f4a7c15ULL ^ heap_secret;
+}
+
+// Recompute the canary after the block's size changed
+static void block_seal(block_t *block) {
+    block->canary = block_canary(block);
+}
+
+static void block_check(block_t *block) {
+    if (block->canary != block_canary(block)) {
+        heap_corrupted("corrupted block header", block);
+    }
+}
+
+// A block merged into its predecessor leaves its header behind in the
+// merged payload; flag it free, so a second free of it is still caught
+static void block_retire(block_t *block) {
+    block->header |= BLOCK_FREE;
+}
+#else
+#define MIN_OBJECT 1
+
+static void block_seal(block_t *block) {
+    (void)block;
+}
+
+static void block_check(block_t *block) {
+    (void)block;
+}
+
+static void block_retire(block_t *block) {
+    (void)block;
+}
+#endif
+
+// ========== Helper Functions ==========
+
+// Get block header from user pointer
+static block_t *get_block_ptr(void *ptr) {
+    return (block_t*)((char*)ptr - BLOCK_SIZE);
+}
+
+// Largest request served; anything bigger fails with ENOMEM before it is
+// rounded, since ALIGN() and the page and chunk rounding after it would wrap
+#define MAX_REQUEST (SIZE_MAX - CHUNK_SIZE)
+
+// Bytes a request of `size` (non-zero, at most MAX_REQUEST) takes: aligned,
+// and at least MIN_OBJECT
+static size_t object_size(size_t size) {
+    assert(size <= MAX_REQUEST);
+    size = ALIGN(size);
+    return size < MIN_OBJECT ? MIN_OBJECT : size;
+}
+
+// User pointer of a block
+static void *block_payload(block_t *block) {
+    return (char*)block + BLOCK_SIZE;
+}
+
+static size_t block_size(block_t *block) {
+    return block->header & ~(size_t)BLOCK_FLAGS;
+}
+
+static int block_is_free(block_t *block) {
+    return block->header & BLOCK_FREE;
+}
+
+// Change a block's size, keeping its flags
+static void set_block_size(block_t *block, size_t size) {
+    block->header = size | (block->header & BLOCK_FLAGS);
+    block_seal(block);
+}
+
+// Chunk header of anything the allocator handed out
+static chunk_t *ptr_chunk(void *ptr) {
+    return (chunk_t*)((uintptr_t)ptr & CHUNK_MASK);
+}
+
+// Slab holding a small object
+static slab_t *ptr_slab(void *ptr) {
+    return (slab_t*)((uintptr_t)ptr & SLAB_MASK);
+}
+
+// Physically next block (the epilogue for the last block of a chunk)
+static block_t *next_block(block_t *block) {
+    return (block_t*)((char*)block_payload(block) + block_size(block));
+}
+
+// Physically previous block if it is free, NULL otherwise
+static block_t *prev_free_block(block_t *block) {
+    if (block->header & BLOCK_PREV_INUSE) {
+        return NULL;
+    }
+    size_t prev_size = *((tag_t*)block - 1);
+    block_t *prev = (block_t*)((char*)block - prev_size - BLOCK_SIZE);
+    block_check(prev);  // Also catches a tag that doesn't match its block
+    return prev;
+}
+
+// Mark a block free: write its tag and tell the next block
+static void set_free(block_t *block) {
+    size_t size = block_size(block);
+    block->header |= BLOCK_FREE;
+    *(tag_t*)((char*)block_payload(block) + size - TAG_SIZE) = size;
+    next_block(block)->header &= ~(size_t)BLOCK_PREV_INUSE;
+}
+
+// Mark a block used and tell the next block
+static void set_used(block_t *block) {
+    block->header &= ~(size_t)BLOCK_FREE;
+    next_block(block)->header |= BLOCK_PREV_INUSE;
+}
+
+// First block of a chunk
+static block_t *chunk_first_block(chunk_t *chunk) {
+    return (block_t*)((char*)chunk + CHUNK_HEADER_SIZE);
+}
+
+// Coarse monotonic clock in milliseconds (cheap enough for the slow path)
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Fine monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Bookkeeping kept in the (otherwise unused) payload of a large free block,
+// right after its links
+typedef struct free_meta {
+    uint64_t freed_at_ms;  // When the block last became free
+    int purged;            // Its interior pages have been given back
+} free_meta_t;
+
+static free_meta_t *free_meta(block_t *block) {
+    return (free_meta_t*)(block + 1);
+}
+
+// Free memory that a chunk has never handed out is still zero from the
+// kernel, except for the few words the bins keep in a free block: its header
+// and links (plus free_meta) at the front and its boundary tag at the back.
+// Everything past a chunk's untouched mark has never been handed out, so it
+// all lies in the chunk's last free block and can be dirty only right at the
+// mark and in that block's tag just before the epilogue.
+#define FREE_BOOKKEEPING (sizeof(block_t) + sizeof(free_meta_t))
+
+// Size class of the statistics: floor(log2(size))
+static size_t stat_class(size_t size) {
+    size_t cls = size ? 63 - __builtin_clzll(size) : 0;
+    return cls < MALLOC_STAT_CLASSES ? cls : MALLOC_STAT_CLASSES - 1;
+}
+
+// Map an (aligned) size to its bin index. A size below ALIGNMENT (a zero or
+// wrapped request) would index far out of every bin and cache array.
+static size_t bin_index(size_t size) {
+    assert(size >= ALIGNMENT);
+    if (size <= SMALL_BIN_MAX) {
+        return size / ALIGNMENT - 1;
+    }
+    size_t log2 = 63 - __builtin_clzll(size);
+    size_t split = (size >> (log2 - LARGE_SPLIT_SHIFT)) & (LARGE_SPLITS - 1);
+    return NUM_SMALL_BINS + (log2 - SMALL_BIN_SHIFT) * LARGE_SPLITS + split;
+}
+
+// Find the first non-empty bin at or after idx, or NUM_BINS if none
+static size_t next_nonempty_bin(heap_t *heap, size_t idx) {
+    if (idx < NUM_SMALL_BINS) {
+        uint64_t bits = heap->small_map & (~0ULL << idx);
+        if (bits) {
+            return __builtin_ctzll(bits);
+        }
+        idx = NUM_SMALL_BINS;
+    }
+
+    size_t cls = (idx - NUM_SMALL_BINS) / LARGE_SPLITS;
+    if (cls >= NUM_LARGE_CLASSES) {
+        return NUM_BINS;
+    }
+
+    uint32_t splits = heap->split_map[cls] & (~0U << ((idx - NUM_SMALL_BINS) % LARGE_SPLITS));
+    if (!splits) {
+        // Nothing left in this class: take the first bin of the next non-empty one
+        uint32_t classes = heap->class_map & (~0U << cls << 1);
+        if (!classes) {
+            return NUM_BINS;
+        }
+        cls = __builtin_ctz(classes);
+        splits = heap->split_map[cls];
+    }
+    return NUM_SMALL_BINS + cls * LARGE_SPLITS + __builtin_ctz(splits);
+}
+
+// Flag a bin as non-empty in the bitmaps
+static void bin_mark(heap_t *heap, size_t idx) {
+    if (idx < NUM_SMALL_BINS) {
+        heap->small_map |= 1ULL << idx;
+        return;
+    }
+    size_t cls = (idx - NUM_SMALL_BINS) / LARGE_SPLITS;
+    heap->split_map[cls] |= 1U << ((idx - NUM_SMALL_BINS) % LARGE_SPLITS);
+    heap->class_map |= 1U << cls;
+}
+
+// Flag a bin as empty in the bitmaps
+static void bin_unmark(heap_t *heap, size_t idx) {
+    if (idx < NUM_SMALL_BINS) {
+        heap->small_map &= ~(1ULL << idx);
+        return;
+    }
+    size_t cls = (idx - NUM_SMALL_BINS) / LARGE_SPLITS;
+    heap->split_map[cls] &= ~(1U << ((idx - NUM_SMALL_BINS) % LARGE_SPLITS));
+    if (!heap->split_map[cls]) {
+        heap->class_map &= ~(1U << cls);
+    }
+}
+
+// Put a free block at the front of its size-class bin
+static void insert_free_block(heap_t *heap, block_t *block) {
+    size_t idx = bin_index(block_size(block));
+    block->prev_free = NULL;
+    block->next_free = heap->bins[idx];
+    if (heap->bins[idx]) {
+        heap->bins[idx]->prev_free = block;
+    }
+    heap->bins[idx] = block;
+    bin_mark(heap, idx);
+
+    heap->stats.free_bytes += BLOCK_SIZE + block_size(block);
+    heap->stats.free_blocks[stat_class(block_size(block))]++;
+
+    if (block_size(block) >= PURGE_MIN_SIZE) {
+        free_meta(block)->freed_at_ms = now_ms();
+        free_meta(block)->purged = 0;
+    }
+}
+
+// Unlink a free block from its size-class bin
+static void remove_free_block(heap_t *heap, block_t *block) {
+    size_t idx = bin_index(block_size(block));
+
+#ifdef HARDENED
+    if ((block->prev_free ? block->prev_free->next_free : heap->bins[idx]) != block ||
+        (block->next_free && block->next_free->prev_free != block)) {
+        heap_corrupted("corrupted free list", block);
+    }
+#endif
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        heap->bins[idx] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (heap->rover == block) {
+        heap->rover = block->next_free;
+    }
+    block->next_free = NULL;
+    block->prev_free = NULL;
+
+    if (!heap->bins[idx]) {
+        bin_unmark(heap, idx);
+    }
+
+    heap->stats.free_bytes -= BLOCK_SIZE + block_size(block);
+    heap->stats.free_blocks[stat_class(block_size(block))]--;
+}
+
+// ========== Lock Profiling ==========
+// Every arena lock is taken with a trylock first, so an uncontended
+// acquisition costs what pthread_mutex_lock does plus a counter increment;
+// only when the trylock fails is the wait timed. Hold times would need two
+// clock reads on every acquisition, so one in LOCK_HOLD_SAMPLE holds is
+// timed and counted LOCK_HOLD_SAMPLE times over. The counters live in the
+// arena's stats and are only touched with the lock held.
+#define LOCK_HOLD_SAMPLE 64
+
+static void heap_lock(heap_t *heap) {
+    if (pthread_mutex_trylock(&heap->lock) != 0) {
+        uint64_t start = now_ns();
+        pthread_mutex_lock(&heap->lock);
+        heap->stats.lock_contended++;
+        heap->stats.lock_wait_ns += now_ns() - start;
+    }
+    if (++heap->stats.lock_acquired % LOCK_HOLD_SAMPLE == 0) {
+        heap->lock_since = now_ns();
+    }
+}
+
+static void heap_unlock(heap_t *heap) {
+    if (heap->lock_since) {
+        heap->stats.lock_hold_ns += (now_ns() - heap->lock_since) * LOCK_HOLD_SAMPLE;
+        heap->lock_since = 0;
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// ========== OS Memory ==========
+
+// Round up to a whole number of pages
+static size_t page_round(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+// Fresh zeroed pages from the kernel. Unlike sbrk() this is thread-safe and
+// any mapping can be handed back on its own, wherever it lies.
+static void *os_map(size_t size) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void os_unmap(void *ptr, size_t size) {
+    munmap(ptr, size);
+}
+
+// Like os_map, but the mapping starts on a boundary of `align` (a power of
+// two): map that much more than needed and unmap the misaligned head and tail
+static void *os_map_aligned(size_t size, size_t align) {
+    char *raw = os_map(size + align);
+    if (!raw) {
+        return NULL;
+    }
+
+    char *aligned = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned > raw) {
+        os_unmap(raw, aligned - raw);
+    }
+    os_unmap(aligned + size, raw + align - aligned);
+    return aligned;
+}
+
+static void *os_map_chunk(size_t size) {
+    return os_map_aligned(size, CHUNK_SIZE);
+}
+
+// Ask for fresh pages to come from a NUMA node when they are first touched,
+// or from the nearest one with free memory if it has none. A failure (say,
+// a node without memory) just leaves the default of the toucher's node.
+static void os_place(void *ptr, size_t size, unsigned int node) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1, 0);
+}
+
+// ========== Huge Pages ==========
+// A heap of many GB in 4 KiB pages needs a TLB entry per page, and misses
+// the TLB constantly. With huge_pages set, arenas map their chunks two at a
+// time, as a region on a 2 MiB boundary that one huge page can back: the
+// region is opted into transparent huge pages with MADV_HUGEPAGE or, where
+// THP is turned off, mapped from the hugetlbfs pool with MAP_HUGETLB. If
+// neither works the arena maps plain chunks as usual. The half not needed
+// yet waits in the arena's spare list and becomes its next chunk, of blocks
+// or of slabs, so hot small objects end up densely packed in huge pages.
+//
+// Nothing may split a huge page afterwards (that would undo the point, and
+// hugetlbfs mappings can't be partially unmapped at all): the purger leaves
+// the free blocks in such chunks alone, heap_trim doesn't drop their unused
+// slab pages, and a chunk it finds completely free goes back to the spare
+// list until the other half of its region (its buddy) is free as well;
+// then the whole region is unmapped.
+
+// THP can be compiled out or turned off; only "madvise" and "always" honour
+// MADV_HUGEPAGE
+static int thp_available(void) {
+    static _Atomic int available = -1;
+    int result = available;
+    if (result < 0) {
+        char buf[128] = "";
+        int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = read(fd, buf, sizeof(buf) - 1);
+            buf[n > 0 ? n : 0] = '\0';
+            close(fd);
+        }
+        result = strstr(buf, "[always]") || strstr(buf, "[madvise]");
+        available = result;
+    }
+    return result;
+}
+
+// Map a huge-page region; *kind says how it is backed
+static void *os_map_huge(int *kind) {
+    if (thp_available()) {
+        void *region = os_map_aligned(HUGE_PAGE_SIZE, HUGE_PAGE_SIZE);
+        if (region && madvise(region, HUGE_PAGE_SIZE, MADV_HUGEPAGE) == 0) {
+            *kind = HUGE_THP;
+            return region;
+        }
+        if (region) {
+            os_unmap(region, HUGE_PAGE_SIZE);
+        }
+    }
+
+    // Huge pages of the default size (2 MiB here) come aligned to their size
+    void *region = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region == MAP_FAILED || ((uintptr_t)region & (HUGE_PAGE_SIZE - 1))) {
+        if (region != MAP_FAILED) {
+            os_unmap(region, HUGE_PAGE_SIZE);
+        }
+        return NULL;
+    }
+    *kind = HUGE_TLB;
+    return region;
+}
+
+static void spare_push(heap_t *heap, chunk_t *chunk, int huge, char *dirty) {
+    chunk->kind = CHUNK_SPARE;
+    chunk->huge = huge;
+    chunk->untouched = dirty;
+    chunk->next = heap->spare_chunks;
+    heap->spare_chunks = chunk;
+    heap->stats.spare_chunks++;
+}
+
+// A fresh, zeroed chunk for an arena: a spare, one half of a new huge-page
+// region, or a plain chunk. Callers fill in the header.
+static chunk_t *heap_map_chunk(heap_t *heap) {
+    chunk_t *chunk = heap->spare_chunks;
+    if (chunk) {
+        heap->spare_chunks = chunk->next;
+        heap->stats.spare_chunks--;
+        int huge = chunk->huge;
+        memset(chunk, 0, chunk->untouched - (char*)chunk);
+        chunk->huge = huge;
+        return chunk;
+    }
+
+    int huge;
+    char *region;
+    int place = numa_nodes > 1 && arena_policy == ARENA_PER_NODE;
+    if (atomic_load_explicit(&huge_pages, memory_order_relaxed) && (region = os_map_huge(&huge))) {
+        if (place) {
+            os_place(region, HUGE_PAGE_SIZE, heap->node);
+        }
+        chunk = (chunk_t*)region;
+        chunk->huge = huge;
+        spare_push(heap, (chunk_t*)(region + CHUNK_SIZE), huge, region + CHUNK_SIZE + sizeof(chunk_t));
+        heap->stats.huge_chunks += 2;
+        return chunk;
+    }
+
+    chunk = os_map_chunk(CHUNK_SIZE);
+    if (chunk && place) {
+        os_place(chunk, CHUNK_SIZE, heap->node);
+    }
+    return chunk;
+}
+
+// Give back a completely free chunk, already unlinked from its list. The
+// bytes up to `dirty` may have been written; a huge chunk waits as a spare
+// until its buddy is free too.
+static void heap_unmap_chunk(heap_t *heap, chunk_t *chunk, char *dirty) {
+    if (!chunk->huge) {
+        os_unmap(chunk, CHUNK_SIZE);
+        return;
+    }
+
+    chunk_t *buddy = (chunk_t*)((uintptr_t)chunk ^ CHUNK_SIZE);
+    for (chunk_t **link = &heap->spare_chunks; *link; link = &(*link)->next) {
+        if (*link == buddy) {
+            *link = buddy->next;
+            heap->stats.spare_chunks--;
+            heap->stats.huge_chunks -= 2;
+            os_unmap((void*)((uintptr_t)chunk & ~(uintptr_t)(HUGE_PAGE_SIZE - 1)), HUGE_PAGE_SIZE);
+            return;
+        }
+    }
+    spare_push(heap, chunk, chunk->huge, dirty);
+}
+
+void my_malloc_set_huge_pages(int enable) {
+    huge_pages = enable != 0;
+}
+
+// Grow an arena by one chunk that starts with a used block spanning the
+// whole chunk; the caller splits off what it doesn't need
+static block_t *request_space(heap_t *heap, size_t size) {
+    heap->stats.request_space++;
+    if (size > MAX_CHUNK_BLOCK) {
+        return NULL;  // Only direct mappings can hold this
+    }
+
+    chunk_t *chunk = heap_map_chunk(heap);
+    if (!chunk) {
+        return NULL;
+    }
+    heap->stats.chunks++;
+    chunk->kind = CHUNK_BLOCKS;
+    chunk->heap = heap;
+
+    block_t *block = chunk_first_block(chunk);
+    block->header = MAX_CHUNK_BLOCK | BLOCK_PREV_INUSE;
+    block_seal(block);
+    chunk->untouched = block_payload(block);
+
+    // Terminate the chunk with a zero-sized, permanently used block
+    block_t *epilogue = next_block(block);
+    epilogue->header = 0 | BLOCK_PREV_INUSE;
+    block_seal(epilogue);
+    chunk->epilogue = epilogue;
+
+    chunk->next = NULL;
+    if (heap->last_chunk) {
+        heap->last_chunk->next = chunk;
+    } else {
+        heap->chunks = chunk;
+    }
+    heap->last_chunk = chunk;
+
+    return block;
+}
+
+// ========== Allocation Strategies ==========
+
+// All fit policies are compiled in; heap_take uses the one chosen with
+// my_malloc_set_strategy (best fit unless the allocator is built with
+// -DFIRST_FIT). Small bins hold one size each, so the policies only differ
+// on large requests, in how they pick among the blocks of a bin.
+
+// First-fit: Find first block large enough.
+// Only the request's own bin can hold blocks that are too small; every block
+// in a higher bin fits, so the search is a bitmap lookup plus one short scan.
+static block_t *find_free_block_first_fit(heap_t *heap, size_t size) {
+    size_t idx = bin_index(size);
+    block_t *current = heap->bins[idx];
+
+    while (current && block_size(current) < size) {
+        current = current->next_free;
+    }
+    if (current) {
+        return current;
+    }
+
+    idx = next_nonempty_bin(heap, idx + 1);
+    return idx < NUM_BINS ? heap->bins[idx] : NULL;
+}
+
+// Best-fit: Find (close to) the smallest block that fits, in bounded time.
+// A large request is rounded up to the next bin boundary first, so every
+// block in the bin found by the bitmap lookup fits and none needs checking.
+// That is TLSF's "good fit": the block is at most one bin width (1/16 of its
+// class) bigger than the tightest one. Only when the lookup comes up empty
+// is the request's own bin scanned for the tightest fit, since the only
+// other option then is mapping a new chunk.
+static block_t *find_free_block_best_fit(heap_t *heap, size_t size) {
+    size_t idx = bin_index(size);
+    size_t start = idx;
+
+    if (size > SMALL_BIN_MAX) {
+        size_t step = (size_t)1 << (63 - __builtin_clzll(size) - LARGE_SPLIT_SHIFT);
+        size_t rounded = (size + step - 1) & ~(step - 1);
+        start = rounded < ((size_t)1 << LARGE_SHIFT_MAX) ? bin_index(rounded) : NUM_BINS;
+    }
+
+    size_t found = next_nonempty_bin(heap, start);
+    if (found < NUM_BINS) {
+        return heap->bins[found];
+    }
+
+    block_t *best = NULL;
+    if (start != idx) {
+        for (block_t *current = heap->bins[idx]; current; current = current->next_free) {
+            if (block_size(current) >= size && (!best || block_size(current) < block_size(best))) {
+                best = current;
+                if (block_size(best) == size) {
+                    break;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+// Next-fit: first fit, but the scan of the request's own bin resumes at the
+// roving pointer, after the block the last search took, and wraps around.
+// First fit always starts at the head, so splinters too small for the
+// sizes being asked for pile up there and every search walks past them
+// again; next fit spreads that cost by not rescanning what it just passed.
+static block_t *find_free_block_next_fit(heap_t *heap, size_t size) {
+    size_t idx = bin_index(size);
+    block_t *start = heap->rover && bin_index(block_size(heap->rover)) == idx ? heap->rover : heap->bins[idx];
+    block_t *current;
+
+    for (current = start; current; current = current->next_free) {
+        if (block_size(current) >= size) {
+            break;
+        }
+    }
+    if (!current && start != heap->bins[idx]) {
+        for (current = heap->bins[idx]; current != start; current = current->next_free) {
+            if (block_size(current) >= size) {
+                break;
+            }
+        }
+        if (current == start) {
+            current = NULL;
+        }
+    }
+    if (!current) {
+        idx = next_nonempty_bin(heap, idx + 1);
+        current = idx < NUM_BINS ? heap->bins[idx] : NULL;
+    }
+    if (current) {
+        heap->rover = current->next_free;
+    }
+    return current;
+}
+
+static block_t *find_free_block(heap_t *heap, size_t size) {
+    switch (atomic_load_explicit(&fit_strategy, memory_order_relaxed)) {
+    case FIT_FIRST:
+        return find_free_block_first_fit(heap, size);
+    case FIT_NEXT:
+        return find_free_block_next_fit(heap, size);
+    default:
+        return find_free_block_best_fit(heap, size);
+    }
+}
+
+void my_malloc_set_strategy(fit_strategy_t strategy) {
+    fit_strategy = strategy;
+}
+
+// Mark a block free and merge it with its free physical neighbours in O(1)
+// using the boundary tags. The neighbours are unlinked from their bins; the
+// caller bins the returned (possibly moved) block.
+static block_t *coalesce(heap_t *heap, block_t *block) {
+    block_t *next = next_block(block);
+    block_check(next);
+    if (block_is_free(next)) {
+        remove_free_block(heap, next);
+        set_block_size(block, block_size(block) + BLOCK_SIZE + block_size(next));
+        heap->stats.coalesces++;
+    }
+
+    block_t *prev = prev_free_block(block);
+    if (prev) {
+        remove_free_block(heap, prev);
+        block_retire(block);
+        set_block_size(prev, block_size(prev) + BLOCK_SIZE + block_size(block));
+        heap->stats.coalesces++;
+        block = prev;
+    }
+
+    set_free(block);
+    return block;
+}
+
+// Split a block if it's too large
+static void split_block(heap_t *heap, block_t *block, size_t size) {
+    if (size < MIN_PAYLOAD) {
+        size = MIN_PAYLOAD;  // Must still hold its links once freed
+    }
+
+    // Only split if remainder is useful (a header and a minimal payload)
+    if (block_size(block) >= size + BLOCK_SIZE + MIN_PAYLOAD) {
+        // Create new block in the remaining space
+        block_t *new_block = (block_t*)((char*)block_payload(block) + size);
+        new_block->header = (block_size(block) - size - BLOCK_SIZE) | BLOCK_PREV_INUSE;
+        block_seal(new_block);
+
+        set_block_size(block, size);
+        heap->stats.splits++;
+
+        // The remainder may border a free block (e.g. when realloc shrinks)
+        insert_free_block(heap, coalesce(heap, new_block));
+    }
+}
+
+// ========== Deferred Coalescing ==========
+// Merging a freed block with its neighbours is wasted work when a block of
+// the same size is allocated again right after, the common pattern in
+// request loops. With fastbin_limit set, heap_free parks blocks of up to
+// FASTBIN_MAX_SIZE bytes in the arena's fastbins instead: one singly-linked
+// list per exact size, through next_free. A parked block keeps its used
+// header, so its neighbours don't merge with it and nothing else needs to
+// know about it; heap_take hands it straight back to a request it fits
+// without a split. heap_consolidate then merges and bins them all in one
+// pass, like heap_free would have one by one: when an allocation finds no
+// other fit, when the fastbins hold more than fastbin_limit bytes, and
+// before trimming. Frees get cheaper at the cost of some fragmentation
+// in between and a longer free now and then.
+
+static size_t fastbin_index(size_t size) {
+    return size / ALIGNMENT - 1;
+}
+
+#ifdef HARDENED
+// A block carrying fast_key may be in a fastbin already; abort if it is
+// (lock held)
+static void fastbin_check_free(heap_t *heap, block_t *block) {
+    if (block->prev_free != (block_t*)fast_key || block_size(block) > FASTBIN_MAX_SIZE) {
+        return;
+    }
+    for (block_t *parked = heap->fastbins[fastbin_index(block_size(block))]; parked;
+         parked = parked->next_free) {
+        if (parked == block) {
+            heap_corrupted("double free", block_payload(block));
+        }
+    }
+}
+#endif
+
+// Park a freed block of at most FASTBIN_MAX_SIZE bytes. A hardened build
+// marks it with fast_key in its prev_free link to catch a second free.
+static void fastbin_push(heap_t *heap, block_t *block) {
+    size_t idx = fastbin_index(block_size(block));
+#ifdef HARDENED
+    fastbin_check_free(heap, block);
+    block->prev_free = (block_t*)fast_key;
+#endif
+    block->next_free = heap->fastbins[idx];
+    heap->fastbins[idx] = block;
+    heap->stats.fast_bytes += BLOCK_SIZE + block_size(block);
+}
+
+// Take a parked block for an aligned size that it fits without a split:
+// at most a header and a minimal payload bigger (see split_block)
+static block_t *fastbin_pop(heap_t *heap, size_t size) {
+    size_t last = fastbin_index(size + BLOCK_SIZE + MIN_PAYLOAD - ALIGNMENT);
+    if (last >= NUM_FASTBINS) {
+        last = NUM_FASTBINS - 1;
+    }
+
+    for (size_t idx = fastbin_index(size); idx <= last; idx++) {
+        block_t *block = heap->fastbins[idx];
+        if (block) {
+#ifdef HARDENED
+            block_check(block);
+            if (block->prev_free != (block_t*)fast_key) {
+                heap_corrupted("corrupted fastbin", block);
+            }
+            block->prev_free = NULL;
+#endif
+            heap->fastbins[idx] = block->next_free;
+            heap->stats.fast_bytes -= BLOCK_SIZE + block_size(block);
+            return block;
+        }
+    }
+    return NULL;
+}
+
+// Merge and bin every parked block
+static void heap_consolidate(heap_t *heap) {
+    for (size_t idx = 0; idx < NUM_FASTBINS && heap->stats.fast_bytes; idx++) {
+        block_t *block = heap->fastbins[idx];
+        heap->fastbins[idx] = NULL;
+        while (block) {
+            block_t *next = block->next_free;
+            heap->stats.fast_bytes -= BLOCK_SIZE + block_size(block);
+            insert_free_block(heap, coalesce(heap, block));
+            block = next;
+        }
+    }
+    heap->stats.consolidations++;
+}
+
+void my_malloc_set_fastbin_limit(size_t limit) {
+    fastbin_limit = limit;
+}
+
+// ========== Purging ==========
+// Free memory is given back in two ways. The whole interior of a large free
+// block (every page between its bookkeeping and its boundary tag) can be
+// dropped with madvise() while the block stays mapped and binned; touching
+// it later simply faults in fresh pages. A chunk that is completely free can
+// be unmapped outright, which only my_malloc_trim does.
+//
+// The amortized purger only drops blocks that have stayed free for
+// purge_decay_ms, so memory that is freed and reused in quick succession
+// keeps its pages. It runs from heap_free, checking the clock once every
+// PURGE_CHECK_INTERVAL frees.
+
+// Drop the interior pages of a free block; returns the bytes advised away
+static size_t purge_block(block_t *block, int advice) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)(free_meta(block) + 1) + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)block_payload(block) + block_size(block) - TAG_SIZE) & ~(page - 1);
+
+    free_meta(block)->purged = 1;
+    if (end <= start || ptr_chunk(block)->huge) {
+        return 0;  // Dropping part of a huge page would split it
+    }
+
+    if (madvise((void*)start, end - start, advice) != 0 && advice != MADV_DONTNEED) {
+        // Kernel without MADV_FREE: use MADV_DONTNEED from now on
+        lazy_advice = MADV_DONTNEED;
+        madvise((void*)start, end - start, MADV_DONTNEED);
+    }
+    return end - start;
+}
+
+// Purge every large free block that became free at or before cutoff_ms
+static size_t heap_purge(heap_t *heap, uint64_t cutoff_ms, int advice) {
+    size_t purged = 0;
+
+    for (size_t idx = next_nonempty_bin(heap, bin_index(PURGE_MIN_SIZE)); idx < NUM_BINS;
+         idx = next_nonempty_bin(heap, idx + 1)) {
+        for (block_t *block = heap->bins[idx]; block; block = block->next_free) {
+            if (block_size(block) >= PURGE_MIN_SIZE && !free_meta(block)->purged &&
+                free_meta(block)->freed_at_ms <= cutoff_ms) {
+                purged += purge_block(block, advice);
+            }
+        }
+    }
+    return purged;
+}
+
+// Run the decay purger if it is due
+static void heap_maybe_purge(heap_t *heap) {
+    long decay = purge_decay_ms;
+    if (decay < 0) {
+        return;  // Disabled
+    }
+
+    uint64_t now = now_ms();
+    if (now - heap->last_purge_ms < (uint64_t)decay) {
+        return;
+    }
+    heap->last_purge_ms = now;
+    heap_purge(heap, now - decay, lazy_advice);
+}
+
+// Unmap completely free chunks beyond the first `pad` bytes of them, then
+// purge every large free block right away; returns 1 if anything was released
+static int heap_trim(heap_t *heap, size_t pad) {
+    if (heap->stats.fast_bytes) {
+        heap_consolidate(heap);  // Parked blocks may be all that keeps a chunk in use
+    }
+
+    size_t kept = 0;
+    int released = 0;
+    chunk_t *prev = NULL;
+    chunk_t *chunk = heap->chunks;
+
+    while (chunk) {
+        chunk_t *next = chunk->next;
+        block_t *first = chunk_first_block(chunk);
+
+        if (block_is_free(first) && block_size(first) == MAX_CHUNK_BLOCK) {
+            if (kept >= pad) {
+                remove_free_block(heap, first);
+                if (prev) {
+                    prev->next = next;
+                } else {
+                    heap->chunks = next;
+                }
+                if (heap->last_chunk == chunk) {
+                    heap->last_chunk = prev;
+                }
+                char *dirty = chunk->untouched + FREE_BOOKKEEPING;
+                heap_unmap_chunk(heap, chunk, dirty < (char*)chunk->epilogue ? dirty : (char*)chunk->epilogue);
+                heap->stats.chunks--;
+                released = 1;
+                chunk = next;
+                continue;
+            }
+            kept += MAX_CHUNK_BLOCK;
+        }
+        prev = chunk;
+        chunk = next;
+    }
+
+    // Slab chunks without a single slab go entirely; in the others, pages
+    // not holding a slab are dropped one run at a time
+    chunk_t **link = &heap->slab_chunks;
+    while ((chunk = *link)) {
+        if (chunk->slabs_used == 0) {
+            *link = chunk->next;
+            heap_unmap_chunk(heap, chunk, (char*)chunk + CHUNK_SIZE);
+            heap->stats.slab_chunks--;
+            released = 1;
+            continue;
+        }
+        for (size_t page = 1; page < CHUNK_PAGES; ) {
+            size_t run = 0;
+            while (page + run < CHUNK_PAGES &&
+                   (chunk->free_pages[(page + run) / 64] & (1ULL << ((page + run) % 64)))) {
+                run++;
+            }
+            if (run && !chunk->huge) {
+                madvise((char*)chunk + page * SLAB_SIZE, run * SLAB_SIZE, MADV_DONTNEED);
+            }
+            page += run + 1;
+        }
+        link = &chunk->next;
+    }
+
+    if (heap_purge(heap, UINT64_MAX, MADV_DONTNEED) > 0) {
+        released = 1;
+    }
+    return released;
+}
+
+// ========== Locked Back End ==========
+// Everything above touches an arena's bins and chunks and must run with
+// that arena's lock held. The thread cache below is the only lock-free path.
+
+// Move a chunk's untouched mark past a block that is being handed out
+static void chunk_touch(block_t *block) {
+    chunk_t *chunk = ptr_chunk(block);
+    char *end = (char*)next_block(block);
+    if (end > chunk->untouched) {
+        chunk->untouched = end;
+    }
+}
+
+// Find or map a block for an aligned size, without touching the chunk's mark
+static block_t *heap_take(heap_t *heap, size_t size) {
+    if (size < MIN_PAYLOAD) {
+        size = MIN_PAYLOAD;
+    }
+
+    // A parked block of the right size needs no search and no split
+    block_t *block;
+    if (heap->stats.fast_bytes && size <= FASTBIN_MAX_SIZE && (block = fastbin_pop(heap, size))) {
+        return block;
+    }
+
+    // Try to find a free block (see Allocation Strategies)
+    block = find_free_block(heap, size);
+    if (!block && heap->stats.fast_bytes) {
+        heap_consolidate(heap);
+        block = find_free_block(heap, size);
+    }
+
+    if (!block) {
+        // No free block found - request more memory
+        block = request_space(heap, size);
+        if (!block) {
+            return NULL;
+        }
+    } else {
+        // Found a free block - take it out of its bin
+        remove_free_block(heap, block);
+        set_used(block);
+    }
+
+    // Return the unused tail to the bins
+    split_block(heap, block, size);
+    return block;
+}
+
+// Carve a block for an aligned size from the bins or from a new chunk
+static block_t *heap_malloc(heap_t *heap, size_t size) {
+    block_t *block = heap_take(heap, size);
+    if (block) {
+        chunk_touch(block);
+    }
+    return block;
+}
+
+// Carve a block whose payload reads as zero. Only the part of it the chunk
+// handed out before (plus the bookkeeping words past the untouched mark) is
+// cleared, so pages nobody has used yet are not even faulted in.
+static block_t *heap_calloc(heap_t *heap, size_t size) {
+    block_t *block = heap_take(heap, size);
+    if (!block) {
+        return NULL;
+    }
+
+    chunk_t *chunk = ptr_chunk(block);
+    char *payload = block_payload(block);
+    char *end = payload + block_size(block);
+    char *dirty_end = chunk->untouched + FREE_BOOKKEEPING;
+
+    if (dirty_end >= end) {
+        memset(payload, 0, end - payload);
+    } else {
+        memset(payload, 0, dirty_end > payload ? dirty_end - payload : 0);
+        memset(end - TAG_SIZE, 0, TAG_SIZE);
+    }
+    chunk_touch(block);
+    return block;
+}
+
+// Return a block to the bins, or park it in a fastbin
+static void heap_free(heap_t *heap, block_t *block) {
+    size_t limit = atomic_load_explicit(&fastbin_limit, memory_order_relaxed);
+    if (limit && block_size(block) <= FASTBIN_MAX_SIZE) {
+        fastbin_push(heap, block);
+        if (heap->stats.fast_bytes > limit) {
+            heap_consolidate(heap);
+        }
+        return;
+    }
+    if (heap->stats.fast_bytes && !limit) {
+        heap_consolidate(heap);  // Deferring was turned off
+    }
+
+    // Merge with free physical neighbours, then file under the new size
+    insert_free_block(heap, coalesce(heap, block));
+
+    if (++heap->purge_ticks >= PURGE_CHECK_INTERVAL) {
+        heap->purge_ticks = 0;
+        heap_maybe_purge(heap);
+    }
+}
+
+// Grow a used block in place by absorbing its free physical successor, then
+// give back whatever is left over. Returns 0, leaving the block alone, if
+// the successor is used or too small.
+static int heap_extend(heap_t *heap, block_t *block, size_t size) {
+    block_t *next = next_block(block);
+    if (!block_is_free(next) || block_size(block) + BLOCK_SIZE + block_size(next) < size) {
+        return 0;
+    }
+
+    remove_free_block(heap, next);
+    set_block_size(block, block_size(block) + BLOCK_SIZE + block_size(next));
+    set_used(block);  // The block after the merged one has a used predecessor again
+    split_block(heap, block, size);
+    chunk_touch(block);
+    return 1;
+}
+
+// Carve up to n blocks of an aligned size into out[], `count` at a time from
+// one run that heap_malloc finds (or maps) as a single block; the run is cut
+// into back-to-back blocks in one pass, and only its last block is split.
+// Returns how many blocks were carved.
+static size_t heap_malloc_batch(heap_t *heap, size_t size, size_t n, void **out) {
+    if (size < MIN_PAYLOAD) {
+        size = MIN_PAYLOAD;
+    }
+
+    size_t stride = BLOCK_SIZE + size;
+    size_t per_run = (MAX_CHUNK_BLOCK + BLOCK_SIZE) / stride;
+    size_t done = 0;
+
+    while (done < n) {
+        size_t count = n - done < per_run ? n - done : per_run;
+        block_t *block = heap_malloc(heap, count * stride - BLOCK_SIZE);
+        if (!block) {
+            break;
+        }
+
+        size_t total = block_size(block);
+        heap->stats.splits += count - 1;
+        for (size_t i = 1; i < count; i++) {
+            set_block_size(block, size);
+            out[done++] = block_payload(block);
+            block = next_block(block);
+            block->header = size | BLOCK_PREV_INUSE;
+            block_seal(block);
+        }
+
+        // The last block takes whatever heap_malloc left over
+        set_block_size(block, total - (count - 1) * stride);
+        out[done++] = block_payload(block);
+        split_block(heap, block, size);
+    }
+    return done;
+}
+
+// Carve a block whose payload is aligned to `align` (a power of two above
+// ALIGNMENT): take a block with enough slack, free the part in front of the
+// first aligned payload that leaves room for a leading block, and trim the
+// tail as usual
+static block_t *heap_memalign(heap_t *heap, size_t size, size_t align) {
+    if (size < MIN_PAYLOAD) {
+        size = MIN_PAYLOAD;
+    }
+
+    block_t *block = heap_malloc(heap, size + align + BLOCK_SIZE + MIN_PAYLOAD);
+    if (!block) {
+        return NULL;
+    }
+
+    uintptr_t payload = (uintptr_t)block_payload(block);
+    if (payload & (align - 1)) {
+        uintptr_t aligned_payload = (payload + BLOCK_SIZE + MIN_PAYLOAD + align - 1) & ~(align - 1);
+        block_t *aligned = (block_t*)(aligned_payload - BLOCK_SIZE);
+        size_t lead = (char*)aligned - (char*)payload;
+
+        aligned->header = (block_size(block) - lead - BLOCK_SIZE) | BLOCK_PREV_INUSE;
+        block_seal(aligned);
+        set_block_size(block, lead);
+        heap->stats.splits++;
+        heap_free(heap, block);  // Clears BLOCK_PREV_INUSE in aligned, unless parked
+        block = aligned;
+    }
+
+    split_block(heap, block, size);
+    return block;
+}
+
+// ========== Slabs ==========
+// Requests up to SLAB_MAX_SIZE bytes are served from slabs: SLAB_SIZE pages
+// cut into equal slots of one size class, with a bitmap of free slots in the
+// page's slab_t. The first free slot is found with a count-trailing-zeros
+// per bitmap word, and objects carry no header, since my_free finds the
+// slab (and from there the slot size) by masking the pointer with SLAB_MASK.
+//
+// Slab pages come from CHUNK_SLABS chunks whose own free-page bitmap is
+// searched the same way. Each arena keeps a list per class of slabs that
+// still have free slots; full slabs are unlinked until a slot frees up, and
+// an empty slab goes back to its chunk unless it is the last one on its list.
+
+static void slab_link(heap_t *heap, slab_t *slab, size_t cls) {
+    slab->prev = NULL;
+    slab->next = heap->slabs[cls];
+    if (heap->slabs[cls]) {
+        heap->slabs[cls]->prev = slab;
+    }
+    heap->slabs[cls] = slab;
+}
+
+static void slab_unlink(heap_t *heap, slab_t *slab, size_t cls) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        heap->slabs[cls] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Map a chunk whose pages (all but the header page) are free for slabs
+static chunk_t *new_slab_chunk(heap_t *heap) {
+    chunk_t *chunk = heap_map_chunk(heap);
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->kind = CHUNK_SLABS;
+    chunk->heap = heap;
+    heap->stats.slab_chunks++;
+    memset(chunk->free_pages, 0xff, sizeof(chunk->free_pages));
+    chunk->free_pages[0] &= ~1ULL;  // Page 0 holds the chunk header
+    chunk->slabs_used = 0;
+
+    chunk->next = heap->slab_chunks;
+    heap->slab_chunks = chunk;
+    return chunk;
+}
+
+// Set up a fresh slab for a class and put it on the class's list
+static slab_t *new_slab(heap_t *heap, size_t obj_size) {
+    chunk_t *chunk = heap->slab_chunks;
+    while (chunk && chunk->slabs_used == CHUNK_PAGES - 1) {
+        chunk = chunk->next;
+    }
+    if (!chunk && !(chunk = new_slab_chunk(heap))) {
+        return NULL;
+    }
+
+    size_t word = 0;
+    while (!chunk->free_pages[word]) {
+        word++;
+    }
+    size_t page = word * 64 + __builtin_ctzll(chunk->free_pages[word]);
+    chunk->free_pages[word] &= ~(1ULL << (page % 64));
+    chunk->slabs_used++;
+
+    slab_t *slab = (slab_t*)((char*)chunk + page * SLAB_SIZE);
+    slab->obj_size = obj_size;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / obj_size;
+    slab->used = 0;
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        size_t first = i * 64;
+        slab->bitmap[i] = first + 64 <= slab->capacity ? ~0ULL
+                        : first < slab->capacity ? (1ULL << (slab->capacity - first)) - 1
+                        : 0;
+    }
+
+    slab_link(heap, slab, bin_index(obj_size));
+    return slab;
+}
+
+// Hand out a slot for an aligned size <= SLAB_MAX_SIZE
+static void *slab_alloc(heap_t *heap, size_t size) {
+    size_t cls = bin_index(size);
+    slab_t *slab = heap->slabs[cls];
+    if (!slab && !(slab = new_slab(heap, size))) {
+        return NULL;
+    }
+
+    size_t word = 0;
+    while (!slab->bitmap[word]) {
+        word++;
+    }
+    size_t slot = word * 64 + __builtin_ctzll(slab->bitmap[word]);
+    slab->bitmap[word] &= slab->bitmap[word] - 1;  // Clear lowest set bit
+
+    if (++slab->used == slab->capacity) {
+        slab_unlink(heap, slab, cls);
+    }
+    heap->stats.slab_bytes += slab->obj_size;
+    return (char*)slab + SLAB_HEADER_SIZE + slot * slab->obj_size;
+}
+
+static void slab_free(heap_t *heap, void *ptr) {
+    slab_t *slab = ptr_slab(ptr);
+    size_t cls = bin_index(slab->obj_size);
+    size_t slot = ((char*)ptr - ((char*)slab + SLAB_HEADER_SIZE)) / slab->obj_size;
+
+    slab->bitmap[slot / 64] |= 1ULL << (slot % 64);
+    heap->stats.slab_bytes -= slab->obj_size;
+    if (slab->used-- == slab->capacity) {
+        slab_link(heap, slab, cls);  // Was full, has room again
+    }
+    if (slab->used > 0 || (!slab->prev && !slab->next)) {
+        return;  // Still in use, or the only slab left for its class
+    }
+
+    // Empty: give the page back to its chunk
+    slab_unlink(heap, slab, cls);
+    chunk_t *chunk = ptr_chunk(slab);
+    size_t page = ((char*)slab - (char*)chunk) / SLAB_SIZE;
+    chunk->free_pages[page / 64] |= 1ULL << (page % 64);
+    chunk->slabs_used--;
+}
+
+// Free an object of this arena, whichever kind of chunk it lives in
+static void heap_release(heap_t *heap, void *ptr) {
+    if (ptr_chunk(ptr)->kind == CHUNK_SLABS) {
+        slab_free(heap, ptr);
+    } else {
+        heap_free(heap, get_block_ptr(ptr));
+    }
+}
+
+// Hardened builds: abort unless ptr is an object that is handed out right
+// now (see Hardening). A slab slot must be on a slot boundary and not free
+// in its bitmap; a block must have an intact canary and no free flag.
+static void check_in_use(void *ptr) {
+#ifdef HARDENED
+    chunk_t *chunk = ptr_chunk(ptr);
+    if ((uintptr_t)ptr & (ALIGNMENT - 1)) {
+        heap_corrupted("free(): invalid pointer", ptr);
+    }
+
+    switch (chunk->kind) {
+    case CHUNK_SLABS: {
+        slab_t *slab = ptr_slab(ptr);
+        size_t offset = (char*)ptr - ((char*)slab + SLAB_HEADER_SIZE);
+        size_t slot = offset / slab->obj_size;
+        if ((char*)ptr < (char*)slab + SLAB_HEADER_SIZE || offset % slab->obj_size ||
+            slot >= slab->capacity) {
+            heap_corrupted("free(): invalid pointer", ptr);
+        }
+        // Other arena threads may be updating the word; any bit of it will do
+        uint64_t bits = __atomic_load_n(&slab->bitmap[slot / 64], __ATOMIC_RELAXED);
+        if (bits & (1ULL << (slot % 64))) {
+            heap_corrupted("double free", ptr);
+        }
+        break;
+    }
+    case CHUNK_BLOCKS:
+    case CHUNK_DIRECT:
+    case CHUNK_GUARDED: {
+        block_t *block = get_block_ptr(ptr);
+        block_check(block);
+        if (block_is_free(block)) {
+            heap_corrupted("double free", ptr);
+        }
+        break;
+    }
+    case CHUNK_QUARANTINED:
+        heap_corrupted("double free", ptr);
+    default:
+        heap_corrupted("free(): invalid pointer", ptr);
+    }
+#else
+    (void)ptr;
+#endif
+}
+
+// Usable bytes behind any pointer the allocator handed out
+static size_t usable_size(void *ptr) {
+    if (ptr_chunk(ptr)->kind == CHUNK_SLABS) {
+        return ptr_slab(ptr)->obj_size;
+    }
+    return block_size(get_block_ptr(ptr));
+}
+
+// ========== Remote Frees ==========
+// An object freed by a thread that isn't bound to the object's arena is
+// pushed onto the owner's intrusive MPSC queue (Vyukov style) instead of
+// taking the owner's lock. A push is one atomic exchange plus one store, so
+// it is wait-free no matter what the other threads are doing. The owner
+// drains the whole queue in one batch the next time it takes its lock in
+// my_malloc. Queued objects stay marked as used and are linked through
+// their first word, so blocks and slab slots share the same queue.
+
+static void remote_push(heap_t *heap, void *ptr) {
+    free_node_t *node = ptr;
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    free_node_t *prev = atomic_exchange_explicit(&heap->remote_head, node, memory_order_acq_rel);
+    // Until this store lands the consumer sees a gap and simply stops there
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Take the oldest queued object, or NULL if the queue is empty (or its only
+// entries are still being linked in by a producer)
+static free_node_t *remote_pop(heap_t *heap) {
+    free_node_t *tail = heap->remote_tail;
+    free_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &heap->remote_stub) {
+        if (!next) {
+            return NULL;
+        }
+        heap->remote_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        heap->remote_tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&heap->remote_head, memory_order_acquire)) {
+        return NULL;  // A push is half done; pick it up next time
+    }
+
+    // tail is the last node: put the stub behind it so it can be handed out
+    remote_push(heap, &heap->remote_stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        heap->remote_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Free everything other threads have queued for this arena (lock held)
+static void remote_drain(heap_t *heap) {
+    if (heap->remote_tail == &heap->remote_stub &&
+        atomic_load_explicit(&heap->remote_head, memory_order_relaxed) == &heap->remote_stub) {
+        return;  // Nothing queued
+    }
+
+    free_node_t *node;
+    while ((node = remote_pop(heap))) {
+        check_in_use(node);  // The same object may have been queued twice
+        heap_release(heap, node);
+        heap->stats.remote_frees++;
+    }
+}
+
+// ========== Direct Mappings ==========
+// A request of mmap_threshold bytes or more gets a mapping of its own:
+//   [chunk_t][block_t][payload ... up to the page boundary]
+// Its chunk header is marked CHUNK_DIRECT, and my_free returns the whole
+// mapping with munmap() right away. Keeping multi-MB buffers out of the
+// arenas stops them from fragmenting the small-object heap.
+
+static void direct_link(chunk_t *chunk) {
+    pthread_mutex_lock(&direct_lock);
+    chunk->prev = NULL;
+    chunk->next = direct_chunks;
+    if (direct_chunks) {
+        direct_chunks->prev = chunk;
+    }
+    direct_chunks = chunk;
+    direct_count++;
+    direct_mapped += chunk->map_size;
+    direct_allocated += block_size(chunk->block);
+    pthread_mutex_unlock(&direct_lock);
+}
+
+static void direct_unlink(chunk_t *chunk) {
+    pthread_mutex_lock(&direct_lock);
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        direct_chunks = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+    direct_count--;
+    direct_mapped -= chunk->map_size;
+    direct_allocated -= block_size(chunk->block);
+    pthread_mutex_unlock(&direct_lock);
+}
+
+// Whether a mapping of `size` bytes after `offset` would overflow once it is
+// rounded up to whole pages, plus the CHUNK_SIZE slack os_map_chunk aligns in
+static int direct_too_big(size_t offset, size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return size > SIZE_MAX - offset - BLOCK_SIZE - page - CHUNK_SIZE;
+}
+
+// Map a block whose payload is aligned to `align` (at least ALIGNMENT and
+// at most MAX_DIRECT_ALIGN); the block sits as far after the chunk header
+// as that takes
+static block_t *direct_alloc(size_t size, size_t align) {
+    pthread_once(&heaps_once, heaps_init);  // Fork handlers (and a hardened build's secret)
+
+    size_t offset = ((CHUNK_HEADER_SIZE + BLOCK_SIZE + align - 1) & ~(align - 1)) - BLOCK_SIZE;
+    if (direct_too_big(offset, size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t map_size = page_round(offset + BLOCK_SIZE + size);
+    chunk_t *chunk = os_map_chunk(map_size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->kind = CHUNK_DIRECT;
+    chunk->heap = NULL;
+    chunk->map_size = map_size;
+
+    block_t *block = (block_t*)((char*)chunk + offset);
+    // The page padding is usable too
+    block->header = (map_size - offset - BLOCK_SIZE) | BLOCK_PREV_INUSE;
+    block_seal(block);
+    chunk->block = block;
+
+    direct_link(chunk);
+    return block;
+}
+
+static void direct_free(block_t *block) {
+    chunk_t *chunk = ptr_chunk(block);
+    direct_unlink(chunk);
+    os_unmap(chunk, chunk->map_size);
+}
+
+// Grow a direct mapping to hold size bytes without copying: extend it where
+// it lies if the address space after it is free, otherwise let the kernel
+// move its pages into a fresh CHUNK_SIZE-aligned range. Returns the
+// (possibly moved) block, or NULL with the old mapping left untouched.
+static block_t *direct_grow(block_t *block, size_t size) {
+    chunk_t *chunk = ptr_chunk(block);
+    size_t offset = (char*)block - (char*)chunk;
+    size_t old_size = chunk->map_size;
+    if (direct_too_big(offset, size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t map_size = page_round(offset + BLOCK_SIZE + size);
+
+    direct_unlink(chunk);
+    chunk_t *moved = mremap(chunk, old_size, map_size, 0);
+    if (moved == MAP_FAILED) {
+        // The destination only reserves an aligned address; MREMAP_FIXED
+        // replaces it with the old pages
+        void *dest = os_map_chunk(map_size);
+        if (dest) {
+            moved = mremap(chunk, old_size, map_size, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+            if (moved == MAP_FAILED) {
+                os_unmap(dest, map_size);
+            }
+        }
+        if (!dest || moved == MAP_FAILED) {
+            direct_link(chunk);
+            return NULL;
+        }
+    }
+
+    moved->map_size = map_size;
+    block = (block_t*)((char*)moved + offset);
+    block->header = (map_size - offset - BLOCK_SIZE) | BLOCK_PREV_INUSE;
+    block_seal(block);
+    moved->block = block;
+    direct_link(moved);
+    return block;
+}
+
+void my_malloc_set_mmap_threshold(size_t threshold) {
+    // Arena chunks can't hold anything bigger than MAX_CHUNK_BLOCK
+    mmap_threshold = threshold < MAX_CHUNK_BLOCK ? threshold : MAX_CHUNK_BLOCK;
+}
+
+// ========== Guarded Allocations ==========
+// A hardened build can serve a random sample of allocations, about one in
+// guard_sample, from mappings of their own, in the style of GWP-ASan:
+//   [chunk_t page][... block_t, payload][PROT_NONE guard page]
+// The payload ends right at the guard page, so touching a byte past its
+// (aligned) end faults on the spot. Freeing one makes its pages
+// inaccessible and keeps it in a quarantine of the last GUARD_QUARANTINE
+// such frees, so a use after free faults too. The header page stays
+// readable, which is how a second free is told apart. Each sampled object
+// costs a few pages and system calls; at a rate in the thousands that is
+// lost in the noise, while a long-running service still covers every call
+// site sooner or later.
+#define GUARD_QUARANTINE 64
+
+static _Atomic unsigned int guard_sample;  // 0 = off
+
+void my_malloc_set_guard_sample(unsigned int rate) {
+    guard_sample = rate;
+}
+
+#ifdef HARDENED
+static chunk_t *guard_quarantine[GUARD_QUARANTINE];
+static size_t guard_quarantine_next;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static THREAD_LOCAL unsigned int guard_countdown;  // Allocations until the next sample
+static THREAD_LOCAL uint64_t guard_rng;
+
+// Should this allocation be sampled? The intervals are random with a mean
+// of guard_sample, so allocations in a fixed pattern can't always miss.
+static int guard_pick(size_t size) {
+    unsigned int rate = atomic_load_explicit(&guard_sample, memory_order_relaxed);
+    if (!rate || size >= mmap_threshold) {
+        return 0;
+    }
+    if (!guard_countdown) {
+        // xorshift64
+        if (!guard_rng) {
+            guard_rng = heap_secret ^ (uintptr_t)&guard_rng;
+        }
+        guard_rng ^= guard_rng << 13;
+        guard_rng ^= guard_rng >> 7;
+        guard_rng ^= guard_rng << 17;
+        guard_countdown = 1 + guard_rng % (2 * (uint64_t)rate - 1);
+    }
+    return --guard_countdown == 0;
+}
+
+// Map a guarded object of an aligned size
+static void *guard_alloc(size_t size) {
+    pthread_once(&heaps_once, heaps_init);
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_size = page + page_round(BLOCK_SIZE + size) + page;
+    chunk_t *chunk = os_map_chunk(map_size);
+    if (!chunk) {
+        return NULL;
+    }
+    char *guard = (char*)chunk + map_size - page;
+    if (mprotect(guard, page, PROT_NONE) != 0) {
+        os_unmap(chunk, map_size);
+        return NULL;
+    }
+
+    chunk->kind = CHUNK_GUARDED;
+    chunk->heap = NULL;
+    chunk->map_size = map_size;
+    block_t *block = (block_t*)(guard - size - BLOCK_SIZE);
+    block->header = size | BLOCK_PREV_INUSE;
+    block_seal(block);
+    chunk->block = block;
+
+    direct_link(chunk);  // Counted and listed like a direct mapping
+    return block_payload(block);
+}
+
+// Lock a freed guarded object away, unmapping the oldest one in quarantine
+static void guard_free(chunk_t *chunk) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    direct_unlink(chunk);
+    chunk->kind = CHUNK_QUARANTINED;
+    mprotect((char*)chunk + page, chunk->map_size - 2 * page, PROT_NONE);
+
+    pthread_mutex_lock(&guard_lock);
+    chunk_t *evicted = guard_quarantine[guard_quarantine_next];
+    guard_quarantine[guard_quarantine_next] = chunk;
+    guard_quarantine_next = (guard_quarantine_next + 1) % GUARD_QUARANTINE;
+    pthread_mutex_unlock(&guard_lock);
+
+    if (evicted) {
+        os_unmap(evicted, evicted->map_size);
+    }
+}
+#endif
+
+// ========== Tracing ==========
+// Trace records go into one shared buffer under trace_lock, which is written
+// to the file whenever it fills up. That serializes traced calls a little,
+// but recording never allocates and the file is in call order. With no
+// trace running, an entry point pays one load and one branch.
+#define TRACE_BUFFER_RECORDS 1024
+
+static _Atomic int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_record_t trace_buffer[TRACE_BUFFER_RECORDS];
+static size_t trace_count;
+static uint64_t trace_start_ns;
+static atomic_uint trace_threads;
+
+// The calling thread's number in traces (0 until its first traced call)
+static THREAD_LOCAL uint32_t trace_thread;
+
+// Write the buffered records out (trace_lock held)
+static void trace_flush(void) {
+    char *data = (char*)trace_buffer;
+    size_t left = trace_count * sizeof(trace_record_t);
+
+    while (left > 0) {
+        ssize_t written = write(trace_fd, data, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // Disk full or similar: drop the records rather than fail the call
+        }
+        data += written;
+        left -= written;
+    }
+    trace_count = 0;
+}
+
+// Add a record to the buffer (trace_lock held)
+static void trace_append(trace_op_t op, size_t size, void *id, uintptr_t arg) {
+    int saved_errno = errno;  // The caller may have set it to report a failure
+
+    if (!trace_thread) {
+        trace_thread = atomic_fetch_add(&trace_threads, 1) + 1;
+    }
+
+    if (trace_fd >= 0) {  // The trace may have stopped since trace() looked
+        trace_record_t *record = &trace_buffer[trace_count++];
+        record->time_ns = now_ns() - trace_start_ns;
+        record->size = size;
+        record->id = (uintptr_t)id;
+        record->arg = arg;
+        record->thread = trace_thread;
+        record->op = op;
+        if (trace_count == TRACE_BUFFER_RECORDS) {
+            trace_flush();
+        }
+    }
+
+    errno = saved_errno;
+}
+
+static void trace_write(trace_op_t op, size_t size, void *id, uintptr_t arg) {
+    pthread_mutex_lock(&trace_lock);
+    trace_append(op, size, id, arg);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static int tracing(void) {
+    return __builtin_expect(atomic_load_explicit(&trace_fd, memory_order_relaxed) >= 0, 0);
+}
+
+// Record a call if a trace is running
+static void trace(trace_op_t op, size_t size, void *id, uintptr_t arg) {
+    if (tracing()) {
+        trace_write(op, size, id, arg);
+    }
+}
+
+// The last records are written out when the program exits
+static pthread_once_t trace_exit_once = PTHREAD_ONCE_INIT;
+
+static void trace_exit_init(void) {
+    atexit(my_malloc_trace_stop);
+}
+
+int my_malloc_trace_start(const char *path) {
+    pthread_once(&heaps_once, heaps_init);  // Registers the fork handlers
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != sizeof(TRACE_MAGIC) - 1) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_once(&trace_exit_once, trace_exit_init);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        trace_flush();
+        close(trace_fd);
+    }
+    trace_count = 0;
+    trace_start_ns = now_ns();
+    trace_fd = fd;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void my_malloc_trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        trace_flush();
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// ========== Fork Safety ==========
+// fork() copies the heap in whatever state the other threads left it, but
+// not the threads themselves. Every lock is taken around the fork, so the
+// child never inherits a lock held by a thread that doesn't exist there.
+// A running trace is flushed first and not continued in the child, whose
+// records would otherwise interleave with the parent's in the same file.
+
+static void prefork(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        trace_flush();
+    }
+    for (unsigned int i = 0; i < heap_count; i++) {
+        pthread_mutex_lock(&heaps[i].lock);
+    }
+    pthread_mutex_lock(&direct_lock);
+#ifdef HARDENED
+    pthread_mutex_lock(&guard_lock);
+#endif
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&prof_lock);
+}
+
+static void postfork(void) {
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&stats_lock);
+#ifdef HARDENED
+    pthread_mutex_unlock(&guard_lock);
+#endif
+    pthread_mutex_unlock(&direct_lock);
+    for (unsigned int i = heap_count; i-- > 0; ) {
+        pthread_mutex_unlock(&heaps[i].lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void stats_postfork_child(void);
+
+static void postfork_child(void) {
+    stats_postfork_child();
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    postfork();
+}
+
+// ========== Arena Binding ==========
+// On a NUMA machine each arena belongs to a node, in turn: arena i to node
+// i % numa_nodes. Under ARENA_PER_NODE a thread re-reads its CPU and node
+// on every slow-path call and moves to one of its node's arenas, picked by
+// CPU, and arenas ask the kernel to place their chunks on their own node
+// (see os_place), so memory is node-local for the threads using it. The
+// other policies ignore nodes, but the statistics still count whether
+// each allocation's arena sat on the caller's node.
+
+// Node numbers the kernel can ever use, from e.g. "0-1"
+static unsigned int numa_node_count(void) {
+    char buf[64] = "";
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        buf[n > 0 ? n : 0] = '\0';
+        close(fd);
+    }
+
+    const char *last = buf;
+    for (const char *c = buf; *c; c++) {
+        if (*c == '-' || *c == ',') {
+            last = c + 1;
+        }
+    }
+    unsigned long count = strtoul(last, NULL, 10) + 1;
+    return count > MAX_NUMA_NODES ? MAX_NUMA_NODES : (unsigned int)count;
+}
+
+static void heaps_init(void) {
+#ifdef HARDENED
+    hardening_init();
+#endif
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    heap_count = cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : (unsigned int)cpus;
+    numa_nodes = numa_node_count();
+
+    for (unsigned int i = 0; i < heap_count; i++) {
+        heap_t *heap = &heaps[i];
+        pthread_mutex_init(&heap->lock, NULL);
+        heap->index = i;
+        heap->node = i % numa_nodes;
+        heap->last_purge_ms = now_ms();
+        heap->remote_tail = &heap->remote_stub;
+        atomic_init(&heap->remote_head, &heap->remote_stub);
+    }
+
+    pthread_atfork(prefork, postfork, postfork_child);
+}
+
+// Arena for the calling thread. Round-robin binds a thread once, on its
+// first allocation; per-CPU and per-node re-read the CPU id on every
+// slow-path call so a thread that migrates follows its core or node.
+static heap_t *current_heap(void) {
+    arena_policy_t policy = arena_policy;
+    if (thread_heap && policy == ARENA_ROUND_ROBIN && numa_nodes == 1) {
+        return thread_heap;
+    }
+
+    pthread_once(&heaps_once, heaps_init);
+
+    unsigned int cpu = 0, node = 0;
+    if (getcpu(&cpu, &node) != 0) {
+        cpu = node = 0;
+    }
+    node %= numa_nodes;
+
+    unsigned int idx;
+    if (policy == ARENA_PER_NODE && heap_count > node) {
+        unsigned int node_arenas = (heap_count - node + numa_nodes - 1) / numa_nodes;
+        idx = node + numa_nodes * (cpu % node_arenas);
+    } else if (policy != ARENA_ROUND_ROBIN) {
+        idx = cpu % heap_count;
+    } else if (thread_heap) {
+        idx = thread_heap->index;  // Bound already; only the node was wanted
+    } else {
+        idx = atomic_fetch_add(&next_arena, 1) % heap_count;
+    }
+    thread_heap = &heaps[idx];
+    thread_node_local = thread_heap->node == node;
+    return thread_heap;
+}
+
+void my_malloc_set_arena_policy(arena_policy_t policy) {
+    arena_policy = policy;
+}
+
+// ========== Trimming ==========
+
+int my_malloc_trim(size_t pad) {
+    int released = 0;
+
+    pthread_once(&heaps_once, heaps_init);
+    for (unsigned int i = 0; i < heap_count; i++) {
+        heap_t *heap = &heaps[i];
+        heap_lock(heap);
+        remote_drain(heap);
+        released |= heap_trim(heap, pad);
+        heap->last_purge_ms = now_ms();
+        heap_unlock(heap);
+    }
+    return released;
+}
+
+void my_malloc_set_decay(long decay_ms) {
+    purge_decay_ms = decay_ms;
+}
+
+// ========== Thread Cache ==========
+// Each thread keeps up to TCACHE_COUNT recently freed objects per small size
+// class. Cached objects stay marked as used, so the back end never merges
+// them, and they are chained through their first word. A malloc/free pair
+// that hits the cache never takes an arena lock. Only objects of the
+// thread's own arena are cached; everything else goes back to its owner.
+#define TCACHE_MAX_SIZE SMALL_BIN_MAX
+#define TCACHE_BINS     NUM_SMALL_BINS
+#define TCACHE_COUNT    16
+
+enum { TCACHE_UNINIT, TCACHE_ACTIVE, TCACHE_DEAD };
+
+// Call counters of one thread (see Statistics)
+typedef struct thread_stats {
+    uint64_t mallocs[MALLOC_STAT_CLASSES];
+    uint64_t frees;
+    uint64_t reallocs;
+    uint64_t tcache_hits;
+    uint64_t node_local;
+    uint64_t node_remote;
+} thread_stats_t;
+
+typedef struct tcache {
+    free_node_t *bins[TCACHE_BINS];
+    unsigned char counts[TCACHE_BINS];
+    int state;
+    thread_stats_t stats;
+    struct tcache *next;               // Live thread caches (under stats_lock)
+    struct tcache *prev;
+} tcache_t;
+
+static THREAD_LOCAL tcache_t tcache;
+
+// Every live thread's cache, and the counters of threads that have exited
+static tcache_t *live_tcaches;
+static thread_stats_t retired_stats;
+
+static void add_thread_stats_to(thread_stats_t *total, thread_stats_t *ts) {
+    for (size_t i = 0; i < MALLOC_STAT_CLASSES; i++) {
+        total->mallocs[i] += ts->mallocs[i];
+    }
+    total->frees += ts->frees;
+    total->reallocs += ts->reallocs;
+    total->tcache_hits += ts->tcache_hits;
+    total->node_local += ts->node_local;
+    total->node_remote += ts->node_remote;
+}
+
+// Stored form of a cache link, and back: hardened builds mask it with the
+// secret and the address it is stored at, so a use after free can neither
+// read a heap address out of it nor plant a usable one
+static free_node_t *cache_link(free_node_t **pos, free_node_t *next) {
+#ifdef HARDENED
+    return (free_node_t*)((uintptr_t)next ^ ((uintptr_t)pos >> 12) ^ heap_secret);
+#else
+    (void)pos;
+    return next;
+#endif
+}
+
+// Park an object in a bin of a thread cache; returns 0 if the bin is full.
+// A hardened build marks it with cache_key in its second word, and checks
+// an object already carrying the mark against the bin, so a double free
+// that the free bit can't see (cached objects still look used) is caught.
+static int tcache_push(tcache_t *tc, size_t idx, void *ptr) {
+    free_node_t *node = ptr;
+#ifdef HARDENED
+    uintptr_t *key = (uintptr_t*)ptr + 1;
+    if (*key == cache_key) {
+        for (free_node_t *cached = tc->bins[idx]; cached; cached = cache_link(&cached->next, cached->next)) {
+            if (cached == node) {
+                heap_corrupted("double free", ptr);
+            }
+        }
+    }
+    if (*key == fast_key && ptr_chunk(ptr)->kind == CHUNK_BLOCKS) {
+        heap_t *heap = ptr_chunk(ptr)->heap;
+        heap_lock(heap);
+        fastbin_check_free(heap, get_block_ptr(ptr));
+        heap_unlock(heap);
+    }
+#endif
+    if (tc->counts[idx] >= TCACHE_COUNT) {
+        return 0;
+    }
+#ifdef HARDENED
+    *key = cache_key;
+#endif
+    node->next = cache_link(&node->next, tc->bins[idx]);
+    tc->bins[idx] = node;
+    tc->counts[idx]++;
+    return 1;
+}
+
+// Take the most recently parked object of a bin, or NULL
+static void *tcache_pop(tcache_t *tc, size_t idx) {
+    free_node_t *node = tc->bins[idx];
+    if (!node) {
+        return NULL;
+    }
+    free_node_t *next = cache_link(&node->next, node->next);
+#ifdef HARDENED
+    if ((uintptr_t)next & (ALIGNMENT - 1)) {
+        heap_corrupted("corrupted thread cache", node);
+    }
+    ((uintptr_t*)node)[1] = 0;
+#endif
+    tc->bins[idx] = next;
+    tc->counts[idx]--;
+    return node;
+}
+
+// Used only for its destructor, which hands the cache back on thread exit
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Give every cached object back to its arena
+static void tcache_flush(void *arg) {
+    tcache_t *tc = arg;
+    tc->state = TCACHE_DEAD;  // Late frees from other destructors go straight to the heap
+
+    heap_t *local = thread_heap;
+    if (local) {
+        heap_lock(local);
+    }
+    for (size_t i = 0; i < TCACHE_BINS; i++) {
+        void *ptr;
+        while ((ptr = tcache_pop(tc, i))) {
+            // The thread may have moved arenas since the object was cached
+            heap_t *heap = ptr_chunk(ptr)->heap;
+            if (heap == local) {
+                heap_release(heap, ptr);
+            } else {
+                remote_push(heap, ptr);
+            }
+        }
+    }
+    if (local) {
+        heap_unlock(local);
+    }
+
+    // Keep the thread's counts after it is gone
+    pthread_mutex_lock(&stats_lock);
+    add_thread_stats_to(&retired_stats, &tc->stats);
+    if (tc->prev) {
+        tc->prev->next = tc->next;
+    } else {
+        live_tcaches = tc->next;
+    }
+    if (tc->next) {
+        tc->next->prev = tc->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+// Is the calling thread's cache usable? Sets it up on first use.
+static int tcache_ready(void) {
+    if (tcache.state == TCACHE_ACTIVE) {
+        return 1;
+    }
+    if (tcache.state == TCACHE_DEAD) {
+        return 0;
+    }
+
+    pthread_once(&tcache_key_once, tcache_key_init);
+    pthread_setspecific(tcache_key, &tcache);
+
+    pthread_mutex_lock(&stats_lock);
+    tcache.prev = NULL;
+    tcache.next = live_tcaches;
+    if (live_tcaches) {
+        live_tcaches->prev = &tcache;
+    }
+    live_tcaches = &tcache;
+    pthread_mutex_unlock(&stats_lock);
+
+    tcache.state = TCACHE_ACTIVE;
+    return 1;
+}
+
+// ========== Statistics ==========
+// Counters cost nothing a malloc/free pair would notice. The back end keeps
+// its counters per arena (heap_stats_t), updated under the arena lock it
+// already holds; bytes in free blocks and the free-list lengths change in
+// insert_free_block and remove_free_block only. Direct mappings are counted
+// under direct_lock. Calls that may never take a lock are counted per
+// thread in its cache, by plain loads and stores rather than atomic
+// read-modify-writes: only the owner writes them, and my_malloc_stats just
+// reads. Everything else (allocated bytes, fragmentation) is derived when
+// the statistics are read.
+
+// Bump one of the calling thread's own counters
+static void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// The counters live in the thread's cache, so this sets it up on a thread's
+// first call. Checking the state first keeps every later call from paying
+// for a function call.
+static int stats_ready(void) {
+    return tcache.state == TCACHE_ACTIVE || (tcache.state == TCACHE_UNINIT && tcache_ready());
+}
+
+static void count_mallocs(size_t size, size_t n) {
+    if (stats_ready()) {
+        stat_add(&tcache.stats.mallocs[stat_class(size)], n);
+        if (numa_nodes > 1) {
+            stat_add(thread_node_local ? &tcache.stats.node_local : &tcache.stats.node_remote, n);
+        }
+    }
+}
+
+static void count_frees(size_t n) {
+    if (stats_ready()) {
+        stat_add(&tcache.stats.frees, n);
+    }
+}
+
+static void count_realloc(void) {
+    if (stats_ready()) {
+        stat_add(&tcache.stats.reallocs, 1);
+    }
+}
+
+static void add_thread_stats(malloc_stats_t *stats, thread_stats_t *ts) {
+    for (size_t i = 0; i < MALLOC_STAT_CLASSES; i++) {
+        uint64_t n = __atomic_load_n(&ts->mallocs[i], __ATOMIC_RELAXED);
+        stats->mallocs_by_class[i] += n;
+        stats->mallocs += n;
+    }
+    stats->frees += __atomic_load_n(&ts->frees, __ATOMIC_RELAXED);
+    stats->reallocs += __atomic_load_n(&ts->reallocs, __ATOMIC_RELAXED);
+    stats->tcache_hits += __atomic_load_n(&ts->tcache_hits, __ATOMIC_RELAXED);
+    stats->node_local += __atomic_load_n(&ts->node_local, __ATOMIC_RELAXED);
+    stats->node_remote += __atomic_load_n(&ts->node_remote, __ATOMIC_RELAXED);
+}
+
+// Only the forking thread lives on in a child. The caches of the others
+// stay mapped but their memory may be reused for new threads, so their
+// counts move to the retired totals and they leave the list.
+static void stats_postfork_child(void) {
+    for (tcache_t *tc = live_tcaches; tc; tc = tc->next) {
+        if (tc != &tcache) {
+            add_thread_stats_to(&retired_stats, &tc->stats);
+        }
+    }
+    live_tcaches = NULL;
+    if (tcache.state == TCACHE_ACTIVE) {
+        tcache.next = tcache.prev = NULL;
+        live_tcaches = &tcache;
+    }
+}
+
+// Size of an arena's biggest free block (lock held): the last block of the
+// highest non-empty bin, or the biggest one in it for a large bin
+static size_t largest_free_block(heap_t *heap) {
+    size_t idx;
+    if (heap->class_map) {
+        size_t cls = 31 - __builtin_clz(heap->class_map);
+        idx = NUM_SMALL_BINS + cls * LARGE_SPLITS + 31 - __builtin_clz(heap->split_map[cls]);
+    } else if (heap->small_map) {
+        idx = 63 - __builtin_clzll(heap->small_map);
+    } else {
+        return 0;
+    }
+
+    size_t largest = 0;
+    for (block_t *block = heap->bins[idx]; block; block = block->next_free) {
+        if (block_size(block) > largest) {
+            largest = block_size(block);
+        }
+    }
+    return largest;
+}
+
+void my_malloc_stats(malloc_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_once(&heaps_once, heaps_init);
+
+    size_t block_chunks = 0, slab_bytes = 0, largest = 0, spare_chunks = 0;
+    for (unsigned int i = 0; i < heap_count; i++) {
+        heap_t *heap = &heaps[i];
+        heap_lock(heap);
+        block_chunks += heap->stats.chunks;
+        stats->chunks += heap->stats.chunks + heap->stats.slab_chunks;
+        spare_chunks += heap->stats.spare_chunks;
+        stats->huge_chunks += heap->stats.huge_chunks;
+        stats->free += heap->stats.free_bytes + heap->stats.fast_bytes;
+        slab_bytes += heap->stats.slab_bytes;
+        stats->request_space += heap->stats.request_space;
+        stats->splits += heap->stats.splits;
+        stats->coalesces += heap->stats.coalesces;
+        stats->consolidations += heap->stats.consolidations;
+        stats->remote_frees += heap->stats.remote_frees;
+        stats->lock_acquired += heap->stats.lock_acquired;
+        stats->lock_contended += heap->stats.lock_contended;
+        stats->lock_wait_ns += heap->stats.lock_wait_ns;
+        stats->lock_hold_ns += heap->stats.lock_hold_ns;
+        for (size_t c = 0; c < MALLOC_STAT_CLASSES; c++) {
+            stats->free_blocks_by_class[c] += heap->stats.free_blocks[c];
+        }
+        size_t heap_largest = largest_free_block(heap);
+        if (heap_largest > largest) {
+            largest = heap_largest;
+        }
+        heap_unlock(heap);
+    }
+
+    pthread_mutex_lock(&direct_lock);
+    stats->direct = direct_count;
+    stats->mapped = (stats->chunks + spare_chunks) * CHUNK_SIZE + direct_mapped;
+    stats->allocated = block_chunks * (CHUNK_SIZE - CHUNK_HEADER_SIZE - BLOCK_SIZE) - stats->free +
+                       slab_bytes + direct_allocated;
+    pthread_mutex_unlock(&direct_lock);
+
+    stats->fragmentation = stats->free ? 1.0 - (double)(largest + BLOCK_SIZE) / stats->free : 0.0;
+
+    pthread_mutex_lock(&stats_lock);
+    add_thread_stats(stats, &retired_stats);
+    for (tcache_t *tc = live_tcaches; tc; tc = tc->next) {
+        add_thread_stats(stats, &tc->stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// ========== Control Interface ==========
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+} stat_field_t;
+
+#define STAT_FIELD(field) \
+    { "stats." #field, offsetof(malloc_stats_t, field), sizeof(((malloc_stats_t*)0)->field) }
+
+static const stat_field_t stat_fields[] = {
+    STAT_FIELD(allocated),
+    STAT_FIELD(mapped),
+    STAT_FIELD(free),
+    STAT_FIELD(chunks),
+    STAT_FIELD(direct),
+    STAT_FIELD(huge_chunks),
+    STAT_FIELD(fragmentation),
+    STAT_FIELD(request_space),
+    STAT_FIELD(splits),
+    STAT_FIELD(coalesces),
+    STAT_FIELD(consolidations),
+    STAT_FIELD(remote_frees),
+    STAT_FIELD(lock_acquired),
+    STAT_FIELD(lock_contended),
+    STAT_FIELD(lock_wait_ns),
+    STAT_FIELD(lock_hold_ns),
+    STAT_FIELD(mallocs),
+    STAT_FIELD(frees),
+    STAT_FIELD(reallocs),
+    STAT_FIELD(tcache_hits),
+    STAT_FIELD(node_local),
+    STAT_FIELD(node_remote),
+    STAT_FIELD(mallocs_by_class),
+    STAT_FIELD(free_blocks_by_class),
+};
+
+// Copy a value out to the caller; oldp NULL just reports its size
+static int ctl_read(void *oldp, size_t *oldlenp, const void *value, size_t size) {
+    if (!oldlenp) {
+        return oldp ? EINVAL : 0;
+    }
+    if (!oldp) {
+        *oldlenp = size;
+        return 0;
+    }
+    if (*oldlenp != size) {
+        return EINVAL;
+    }
+    memcpy(oldp, value, size);
+    return 0;
+}
+
+int my_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
+    for (size_t i = 0; i < sizeof(stat_fields) / sizeof(stat_fields[0]); i++) {
+        if (strcmp(name, stat_fields[i].name) == 0) {
+            if (newp) {
+                return EPERM;
+            }
+            malloc_stats_t stats;
+            my_malloc_stats(&stats);
+            return ctl_read(oldp, oldlenp, (char*)&stats + stat_fields[i].offset, stat_fields[i].size);
+        }
+    }
+
+    if (strcmp(name, "arenas.count") == 0) {
+        if (newp) {
+            return EPERM;
+        }
+        pthread_once(&heaps_once, heaps_init);
+        unsigned int count = heap_count;
+        return ctl_read(oldp, oldlenp, &count, sizeof(count));
+    }
+    if (strcmp(name, "arenas.nodes") == 0) {
+        if (newp) {
+            return EPERM;
+        }
+        pthread_once(&heaps_once, heaps_init);
+        unsigned int count = numa_nodes;
+        return ctl_read(oldp, oldlenp, &count, sizeof(count));
+    }
+
+    // Tunables: the old value is read before the new one is applied
+    if (strcmp(name, "opt.mmap_threshold") == 0) {
+        size_t value = mmap_threshold;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_mmap_threshold(*(size_t*)newp);
+        }
+        return err;
+    }
+    if (strcmp(name, "opt.decay_ms") == 0) {
+        long value = purge_decay_ms;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_decay(*(long*)newp);
+        }
+        return err;
+    }
+    if (strcmp(name, "opt.fastbin_limit") == 0) {
+        size_t value = fastbin_limit;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_fastbin_limit(*(size_t*)newp);
+        }
+        return err;
+    }
+    if (strcmp(name, "opt.huge_pages") == 0) {
+        int value = huge_pages;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_huge_pages(*(int*)newp);
+        }
+        return err;
+    }
+    if (strcmp(name, "opt.guard_sample") == 0) {
+        unsigned int value = guard_sample;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_guard_sample(*(unsigned int*)newp);
+        }
+        return err;
+    }
+    if (strcmp(name, "opt.strategy") == 0) {
+        fit_strategy_t value = fit_strategy;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_strategy(*(fit_strategy_t*)newp);
+        }
+        return err;
+    }
+    if (strcmp(name, "opt.arena_policy") == 0) {
+        arena_policy_t value = arena_policy;
+        if (newp && newlen != sizeof(value)) {
+            return EINVAL;
+        }
+        int err = ctl_read(oldp, oldlenp, &value, sizeof(value));
+        if (!err && newp) {
+            my_malloc_set_arena_policy(*(arena_policy_t*)newp);
+        }
+        return err;
+    }
+    return ENOENT;
+}
+
+// ========== Heap Profiling ==========
+// Allocations are sampled on average once every prof_sample_bytes bytes.
+// Each thread counts down the bytes left until its next sample, so the
+// malloc path pays one subtraction and a branch; the intervals are drawn
+// from an exponential distribution (geometric sampling, as in tcmalloc),
+// which makes the chance of an allocation being sampled depend only on its
+// size and lets pprof scale the samples back up to totals.
+//
+// A sampled object is always carved as an arena block (or a direct
+// mapping), never a slab slot, and carries BLOCK_SAMPLED in its header, so
+// my_free recognizes it from the header word it reads anyway. Its stack is
+// captured with backtrace() and counted against its allocation site; the
+// site keeps cumulative counts and the sampled objects still live. Both
+// tables are mapped once by my_malloc_prof_start and never allocate.
+#define PROF_DEFAULT_SAMPLE (512 * 1024)
+#define PROF_MAX_DEPTH      32
+#define PROF_MAX_SITES      4096       // Distinct allocation stacks
+#define PROF_MAX_LIVE       (1 << 16)  // Sampled objects live at once
+
+// Frames of wrappers around the my_* functions to leave out of the stacks
+// too; libmyalloc.so is built with 1, for its malloc, calloc and realloc
+#ifndef PROF_CALLER_FRAMES
+#define PROF_CALLER_FRAMES 0
+#endif
+#define PROF_MAX_SKIP       (3 + PROF_CALLER_FRAMES)
+#define PROF_RECHECK_BYTES  (64L * 1024 * 1024)  // Between checks while off
+
+typedef struct prof_site {
+    uint64_t hash;                     // 0 = unused slot
+    unsigned int depth;
+    void *pcs[PROF_MAX_DEPTH];
+    uint64_t alloc_count;              // Sampled so far
+    uint64_t alloc_bytes;
+    uint64_t live_count;               // Sampled and not yet freed
+    uint64_t live_bytes;
+} prof_site_t;
+
+typedef struct prof_object {
+    void *ptr;                         // NULL = unused slot
+    size_t size;                       // Bytes requested
+    unsigned int site;
+} prof_object_t;
+
+static _Atomic size_t prof_sample_bytes;  // 0 = off
+static prof_site_t *prof_sites;           // Open addressing by stack hash
+static prof_object_t *prof_live;          // Open addressing by address
+static size_t prof_live_count;
+
+static THREAD_LOCAL long prof_countdown;   // Bytes until the thread's next sample
+static THREAD_LOCAL uint64_t prof_rng;
+
+// Count an allocation against the thread's countdown; true when it is due
+// for a sample (or, with profiling off, for a look at whether it is on)
+static int prof_tick(size_t size) {
+    prof_countdown -= (long)size;
+    return __builtin_expect(prof_countdown < 0, 0);
+}
+
+// Natural logarithm of x >= 1, to within about 1e-6, without libm
+static double prof_log(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int)(bits >> 52) - 1023;
+    bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    double m;
+    memcpy(&m, &bits, sizeof(m));  // Mantissa in [1, 2)
+
+    // ln(m) = 2 atanh(t), with t = (m - 1) / (m + 1) at most 1/3
+    double t = (m - 1) / (m + 1);
+    double t2 = t * t;
+    return exponent * 0.6931471805599453 +
+           2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+}
+
+// Restart the thread's countdown; returns whether profiling is on
+static int prof_rearm(void) {
+    size_t mean = atomic_load_explicit(&prof_sample_bytes, memory_order_relaxed);
+    if (!mean) {
+        prof_countdown = PROF_RECHECK_BYTES;
+        return 0;
+    }
+
+    // xorshift64, and an exponential interval: -ln(u) * mean for u in (0, 1]
+    if (!prof_rng) {
+        prof_rng = (uintptr_t)&prof_rng ^ ((uint64_t)now_ms() << 20);
+    }
+    prof_rng ^= prof_rng << 13;
+    prof_rng ^= prof_rng >> 7;
+    prof_rng ^= prof_rng << 17;
+    double u = (double)((prof_rng >> 11) + 1);  // 1 .. 2^53
+    double interval = (53 * 0.6931471805599453 - prof_log(u)) * (double)mean;
+    prof_countdown = interval < 1 ? 1 : interval > (double)LONG_MAX / 2 ? LONG_MAX / 2 : (long)interval;
+    return 1;
+}
+
+static int prof_sampled(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    int kind = ptr_chunk(ptr)->kind;
+    return (kind == CHUNK_BLOCKS || kind == CHUNK_DIRECT) && (get_block_ptr(ptr)->header & BLOCK_SAMPLED);
+}
+
+static size_t prof_hash_ptr(void *ptr) {
+    return (size_t)(((uintptr_t)ptr >> 3) * 0x9e3779b97f4a7c15ULL >> 48) & (PROF_MAX_LIVE - 1);
+}
+
+// Find or add the site of a stack (prof_lock held); -1 if the table is full
+static long prof_site(void **pcs, unsigned int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a over the addresses
+    for (unsigned int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+    }
+    hash |= 1;
+
+    for (size_t n = 0, idx = hash % PROF_MAX_SITES; n < PROF_MAX_SITES; n++, idx = (idx + 1) % PROF_MAX_SITES) {
+        prof_site_t *site = &prof_sites[idx];
+        if (!site->hash) {
+            site->hash = hash;
+            site->depth = depth;
+            memcpy(site->pcs, pcs, depth * sizeof(void*));
+            return idx;
+        }
+        if (site->hash == hash && site->depth == depth && !memcmp(site->pcs, pcs, depth * sizeof(void*))) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+// Carve a sampled object and record where it was allocated. The stack
+// starts at the program's call into the allocator: `frames` is the number
+// of allocator functions between that call and this one. Only the tail of
+// this is under prof_lock; the stack is captured before taking it.
+__attribute__((noinline, cold))
+static void *prof_malloc(size_t size, int zero, int frames) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    int skip = 1 + frames + PROF_CALLER_FRAMES;
+    void *pcs[PROF_MAX_DEPTH + PROF_MAX_SKIP];
+    int depth = backtrace(pcs, PROF_MAX_DEPTH + skip) - skip;
+    if (depth < 0) {
+        depth = 0;
+    }
+
+    size_t aligned = object_size(size);
+    block_t *block;
+    heap_t *heap = NULL;
+    if (aligned >= mmap_threshold) {
+        block = direct_alloc(aligned, ALIGNMENT);  // Fresh from mmap, so already zero
+        if (!block) {
+            return NULL;
+        }
+    } else {
+        heap = current_heap();
+        heap_lock(heap);
+        remote_drain(heap);
+        block = zero ? heap_calloc(heap, aligned) : heap_malloc(heap, aligned);
+        if (!block) {
+            heap_unlock(heap);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    long site = prof_live_count < PROF_MAX_LIVE / 2 ? prof_site(pcs + skip, depth) : -1;
+    if (site >= 0) {
+        void *ptr = block_payload(block);
+        size_t idx = prof_hash_ptr(ptr);
+        while (prof_live[idx].ptr) {
+            idx = (idx + 1) & (PROF_MAX_LIVE - 1);
+        }
+        prof_live[idx] = (prof_object_t){ ptr, size, (unsigned int)site };
+        prof_live_count++;
+        prof_sites[site].alloc_count++;
+        prof_sites[site].alloc_bytes += size;
+        prof_sites[site].live_count++;
+        prof_sites[site].live_bytes += size;
+        block->header |= BLOCK_SAMPLED;  // Under the arena lock: neighbours update this word too
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    if (heap) {
+        heap_unlock(heap);
+    }
+    return block_payload(block);
+}
+
+// Drop a sampled object from the live profile before it is freed
+__attribute__((noinline, cold))
+static void prof_free(void *ptr) {
+    chunk_t *chunk = ptr_chunk(ptr);
+    if (chunk->heap) {
+        heap_lock(chunk->heap);
+    }
+    get_block_ptr(ptr)->header &= ~(size_t)BLOCK_SAMPLED;
+    if (chunk->heap) {
+        heap_unlock(chunk->heap);
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    size_t idx = prof_hash_ptr(ptr);
+    while (prof_live[idx].ptr && prof_live[idx].ptr != ptr) {
+        idx = (idx + 1) & (PROF_MAX_LIVE - 1);
+    }
+    if (prof_live[idx].ptr) {
+        prof_site_t *site = &prof_sites[prof_live[idx].site];
+        site->live_count--;
+        site->live_bytes -= prof_live[idx].size;
+        prof_live_count--;
+
+        // Backward-shift deletion keeps every probe sequence unbroken
+        size_t hole = idx;
+        for (size_t next = (hole + 1) & (PROF_MAX_LIVE - 1); prof_live[next].ptr;
+             next = (next + 1) & (PROF_MAX_LIVE - 1)) {
+            size_t home = prof_hash_ptr(prof_live[next].ptr);
+            if (((next - home) & (PROF_MAX_LIVE - 1)) >= ((next - hole) & (PROF_MAX_LIVE - 1))) {
+                prof_live[hole] = prof_live[next];
+                hole = next;
+            }
+        }
+        prof_live[hole].ptr = NULL;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Called on every free: one test of a header bit for arena blocks
+static void prof_check_free(void *ptr) {
+    if (prof_sampled(ptr)) {
+        prof_free(ptr);
+    }
+}
+
+int my_malloc_prof_start(size_t sample_bytes) {
+    pthread_mutex_lock(&prof_lock);
+    if (!prof_sites) {
+        prof_sites = os_map(PROF_MAX_SITES * sizeof(prof_site_t));
+        prof_live = os_map(PROF_MAX_LIVE * sizeof(prof_object_t));
+        if (!prof_sites || !prof_live) {
+            if (prof_sites) {
+                os_unmap(prof_sites, PROF_MAX_SITES * sizeof(prof_site_t));
+            }
+            if (prof_live) {
+                os_unmap(prof_live, PROF_MAX_LIVE * sizeof(prof_object_t));
+            }
+            prof_sites = NULL;
+            prof_live = NULL;
+            pthread_mutex_unlock(&prof_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    // The first backtrace() loads the unwinder, which allocates
+    void *pcs[1];
+    backtrace(pcs, 1);
+
+    pthread_once(&heaps_once, heaps_init);  // Registers the fork handlers
+    prof_sample_bytes = sample_bytes ? sample_bytes : PROF_DEFAULT_SAMPLE;
+    prof_countdown = 0;  // This thread picks it up right away
+    return 0;
+}
+
+void my_malloc_prof_stop(void) {
+    prof_sample_bytes = 0;
+}
+
+// Buffered output for the dump
+typedef struct {
+    int fd;
+    size_t used;
+    int failed;
+    char buf[4096];
+} prof_out_t;
+
+static void prof_flush(prof_out_t *out) {
+    for (size_t done = 0; done < out->used && !out->failed; ) {
+        ssize_t n = write(out->fd, out->buf + done, out->used - done);
+        if (n < 0 && errno != EINTR) {
+            out->failed = 1;
+        } else if (n > 0) {
+            done += n;
+        }
+    }
+    out->used = 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void prof_printf(prof_out_t *out, const char *fmt, ...) {
+    if (out->used + 512 > sizeof(out->buf)) {
+        prof_flush(out);
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->used, sizeof(out->buf) - out->used, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        out->used += (size_t)n < sizeof(out->buf) - out->used ? (size_t)n : sizeof(out->buf) - out->used - 1;
+    }
+}
+
+// The legacy text heap profile (gperftools' "heap_v2"), which pprof reads:
+// a totals line, one line per site with live and cumulative counts and its
+// stack, then the address space layout so pprof can symbolize the stacks.
+// Sites that have never had a sample are left out.
+int my_malloc_prof_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    prof_out_t out = { .fd = fd };
+
+    pthread_mutex_lock(&prof_lock);
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; prof_sites && i < PROF_MAX_SITES; i++) {
+        live_count += prof_sites[i].live_count;
+        live_bytes += prof_sites[i].live_bytes;
+        alloc_count += prof_sites[i].alloc_count;
+        alloc_bytes += prof_sites[i].alloc_bytes;
+    }
+    size_t period = prof_sample_bytes ? prof_sample_bytes : PROF_DEFAULT_SAMPLE;
+    prof_printf(&out, "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%zu\n",
+                (unsigned long long)live_count, (unsigned long long)live_bytes,
+                (unsigned long long)alloc_count, (unsigned long long)alloc_bytes, period);
+
+    for (size_t i = 0; prof_sites && i < PROF_MAX_SITES; i++) {
+        prof_site_t *site = &prof_sites[i];
+        if (!site->alloc_count) {
+            continue;
+        }
+        prof_printf(&out, "%6llu: %8llu [%6llu: %8llu] @",
+                    (unsigned long long)site->live_count, (unsigned long long)site->live_bytes,
+                    (unsigned long long)site->alloc_count, (unsigned long long)site->alloc_bytes);
+        for (unsigned int d = 0; d < site->depth; d++) {
+            prof_printf(&out, " %p", site->pcs[d]);
+        }
+        prof_printf(&out, "\n");
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    prof_flush(&out);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t n;
+        while ((n = read(maps, out.buf, sizeof(out.buf))) > 0) {
+            out.used = n;
+            prof_flush(&out);
+        }
+        close(maps);
+    }
+
+    if (close(fd) != 0 || out.failed) {
+        return -1;
+    }
+    return 0;
+}
+
+// ========== Public API ==========
+// Each entry point is a static do_* function wrapped by its my_* name,
+// which records the call if a trace is running. Internal calls go to the
+// do_* functions, so a realloc is traced once rather than as malloc + free.
+
+static void *do_malloc(size_t size) {
+    if (size <= 0) {
+        return NULL;
+    }
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Align size for performance and correctness
+    size = object_size(size);
+
+#ifdef HARDENED
+    if (guard_pick(size)) {
+        void *ptr = guard_alloc(size);
+        if (ptr) {
+            return ptr;
+        }
+    }
+#endif
+
+    // Fast path: reuse an object this thread freed recently
+    if (size <= TCACHE_MAX_SIZE && tcache_ready()) {
+        void *ptr = tcache_pop(&tcache, bin_index(size));
+        if (ptr) {
+            stat_add(&tcache.stats.tcache_hits, 1);
+            return ptr;
+        }
+    }
+
+    if (size >= mmap_threshold) {
+        block_t *block = direct_alloc(size, ALIGNMENT);
+        return block ? block_payload(block) : NULL;
+    }
+
+    heap_t *heap = current_heap();
+    void *ptr = NULL;
+    heap_lock(heap);
+    remote_drain(heap);
+    if (size <= SLAB_MAX_SIZE) {
+        ptr = slab_alloc(heap, size);
+    } else {
+        block_t *block = heap_malloc(heap, size);
+        if (block) {
+            // Return pointer to usable memory (after header)
+            ptr = block_payload(block);
+        }
+    }
+    heap_unlock(heap);
+
+    return ptr;
+}
+
+void *my_malloc(size_t size) {
+    void *ptr = prof_tick(size) && prof_rearm() ? prof_malloc(size, 0, 1) : do_malloc(size);
+    count_mallocs(size, 1);
+    trace(TRACE_MALLOC, size, ptr, 0);
+    return ptr;
+}
+
+static void do_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    check_in_use(ptr);
+    prof_check_free(ptr);
+    chunk_t *chunk = ptr_chunk(ptr);
+    if (chunk->kind == CHUNK_DIRECT) {
+        direct_free(get_block_ptr(ptr));
+        return;
+    }
+#ifdef HARDENED
+    if (chunk->kind == CHUNK_GUARDED) {
+        guard_free(chunk);
+        return;
+    }
+#endif
+    heap_t *heap = chunk->heap;
+
+    // Objects of another arena go to its remote queue without taking its lock
+    if (heap != thread_heap) {
+        remote_push(heap, ptr);
+        return;
+    }
+
+    // Fast path: park small objects of our own arena in the thread cache
+    size_t size = usable_size(ptr);
+    if (size <= TCACHE_MAX_SIZE && tcache_ready() && tcache_push(&tcache, bin_index(size), ptr)) {
+        return;
+    }
+
+    heap_lock(heap);
+    heap_release(heap, ptr);
+    heap_unlock(heap);
+}
+
+void my_free(void *ptr) {
+    if (ptr) {
+        count_frees(1);
+        trace(TRACE_FREE, 0, ptr, 0);
+    }
+    do_free(ptr);
+}
+
+// The caller vouches for the size, so a small object goes into the thread
+// cache without reading its slab or block header to find its class. Any
+// size from the one passed to my_malloc up to my_malloc_usable_size works:
+// the cache only promises that its entries are at least their class size.
+// (A hardened build still checks the object; see check_in_use.)
+void my_free_sized(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    count_frees(1);
+    trace(TRACE_FREE, 0, ptr, 0);
+
+    if (size && size <= TCACHE_MAX_SIZE && thread_heap && ptr_chunk(ptr)->heap == thread_heap &&
+        tcache_ready()) {
+        check_in_use(ptr);
+        prof_check_free(ptr);
+        if (tcache_push(&tcache, bin_index(object_size(size)), ptr)) {
+            return;
+        }
+    }
+
+    do_free(ptr);
+}
+
+size_t my_malloc_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    return usable_size(ptr);
+}
+
+static void *do_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return do_malloc(size);
+    }
+
+    if (size == 0) {
+        do_free(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;  // ptr stays as it was, like any failed realloc
+        return NULL;
+    }
+
+    check_in_use(ptr);
+    chunk_t *chunk = ptr_chunk(ptr);
+    size_t old_size = usable_size(ptr);
+    size = ALIGN(size);
+
+    if (old_size >= size) {
+        // Current block is large enough. Slab slots have a fixed size and
+        // direct mappings are kept as they are; arena blocks give back
+        // their tail.
+        if (chunk->kind == CHUNK_BLOCKS) {
+            heap_t *heap = chunk->heap;
+            heap_lock(heap);
+            split_block(heap, get_block_ptr(ptr), size);
+            heap_unlock(heap);
+        }
+        return ptr;
+    }
+
+    // Try to grow without moving: a direct mapping is remapped (which at
+    // worst moves page table entries, never the data), an arena block takes
+    // over a free neighbour. An arena block growing past mmap_threshold is
+    // moved out to a mapping of its own instead.
+    if (chunk->kind == CHUNK_DIRECT) {
+        block_t *block = direct_grow(get_block_ptr(ptr), size);
+        if (block) {
+            return block_payload(block);
+        }
+    } else if (chunk->kind == CHUNK_BLOCKS && size < mmap_threshold) {
+        heap_t *heap = chunk->heap;
+        heap_lock(heap);
+        int grown = heap_extend(heap, get_block_ptr(ptr), size);
+        heap_unlock(heap);
+        if (grown) {
+            return ptr;
+        }
+    }
+
+    // Need to allocate new block
+    void *new_ptr = do_malloc(size);
+    if (!new_ptr) {
+        return NULL;
+    }
+
+    // Copy old data to new location
+    memcpy(new_ptr, ptr, old_size);
+    do_free(ptr);
+
+    return new_ptr;
+}
+
+// Sampled objects are never resized in place: they move, so the profiler
+// sees the old object freed and (if this call is sampled) the new one
+// allocated (see Heap Profiling)
+__attribute__((noinline))
+static void *prof_realloc(void *ptr, size_t size, int sample) {
+    if (ptr && size == 0) {
+        do_free(ptr);
+        return NULL;
+    }
+    void *new_ptr = sample ? prof_malloc(size, 0, 2) : do_malloc(size);
+    if (ptr && new_ptr) {
+        size_t old_size = usable_size(ptr);
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        do_free(ptr);
+    }
+    return new_ptr;
+}
+
+static void *realloc_call(void *ptr, size_t size) {
+    int sample = prof_tick(size) && prof_rearm();
+    return sample || prof_sampled(ptr) ? prof_realloc(ptr, size, sample) : do_realloc(ptr, size);
+}
+
+// A realloc that moves frees the old block, and another thread can get its
+// address straight back. While tracing, the call and its record happen under
+// trace_lock, so that thread's malloc can't be recorded first and look like
+// the new owner of an object the realloc still takes.
+void *my_realloc(void *ptr, size_t size) {
+    void *new_ptr;
+    if (tracing()) {
+        pthread_mutex_lock(&trace_lock);
+        new_ptr = realloc_call(ptr, size);
+        trace_append(TRACE_REALLOC, size, new_ptr, (uintptr_t)ptr);
+        pthread_mutex_unlock(&trace_lock);
+    } else {
+        new_ptr = realloc_call(ptr, size);
+    }
+    count_realloc();
+    return new_ptr;
+}
+
+// Zero-filled memory without touching more of it than necessary. Direct
+// mappings are fresh from mmap() and so already zero; arena blocks are
+// cleared by heap_calloc, which skips memory that was never used. Only
+// objects small enough for the thread cache or a slab are plainly memset.
+static void *do_calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t total = nmemb * size;
+    if (total == 0) {
+        return NULL;
+    }
+    if (total > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t aligned = ALIGN(total);
+    if (aligned <= TCACHE_MAX_SIZE) {
+        void *ptr = do_malloc(aligned);
+        if (ptr) {
+            memset(ptr, 0, aligned);
+        }
+        return ptr;
+    }
+
+    block_t *block;
+    if (aligned >= mmap_threshold) {
+        block = direct_alloc(aligned, ALIGNMENT);
+    } else {
+        heap_t *heap = current_heap();
+        heap_lock(heap);
+        remote_drain(heap);
+        block = heap_calloc(heap, aligned);
+        heap_unlock(heap);
+    }
+    return block ? block_payload(block) : NULL;
+}
+
+void *my_calloc(size_t nmemb, size_t size) {
+    void *ptr;
+    if (prof_tick(nmemb * size) && (!size || nmemb <= SIZE_MAX / size) && prof_rearm()) {
+        ptr = prof_malloc(nmemb * size, 1, 1);
+    } else {
+        ptr = do_calloc(nmemb, size);
+    }
+    count_mallocs(nmemb * size, 1);
+    trace(TRACE_CALLOC, nmemb * size, ptr, 0);
+    return ptr;
+}
+
+// ========== Aligned Allocation ==========
+// Arena blocks are carved to the alignment out of a larger free block (see
+// heap_memalign); large requests get a direct mapping with the block placed
+// so that its payload lands on the boundary. Slabs are skipped: their slots
+// are only ALIGNMENT-aligned.
+
+// Chunk headers are found by masking, so a direct block's payload must lie
+// in the mapping's first CHUNK_SIZE bytes
+#define MAX_DIRECT_ALIGN (CHUNK_SIZE / 2)
+
+static void *do_memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return do_malloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    if (alignment > MAX_DIRECT_ALIGN || size > MAX_REQUEST - 2 * alignment) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size = ALIGN(size);
+    block_t *block;
+    if (size + alignment + BLOCK_SIZE + MIN_PAYLOAD >= mmap_threshold) {
+        block = direct_alloc(size, alignment);
+    } else {
+        heap_t *heap = current_heap();
+        heap_lock(heap);
+        remote_drain(heap);
+        block = heap_memalign(heap, size, alignment);
+        heap_unlock(heap);
+    }
+
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return block_payload(block);
+}
+
+void *my_memalign(size_t alignment, size_t size) {
+    void *ptr = do_memalign(alignment, size);
+    count_mallocs(size, 1);
+    trace(TRACE_MEMALIGN, size, ptr, alignment);
+    return ptr;
+}
+
+void *my_aligned_alloc(size_t alignment, size_t size) {
+    return my_memalign(alignment, size);
+}
+
+int my_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+
+    int saved = errno;
+    void *ptr = my_memalign(alignment, size);
+    if (!ptr && size) {
+        int err = errno;
+        errno = saved;
+        return err;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+// ========== Batch Allocation ==========
+
+static size_t do_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0) {
+        return 0;
+    }
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return 0;
+    }
+    size = object_size(size);
+
+    size_t done = 0;
+    if (size >= mmap_threshold) {
+        while (done < n) {
+            block_t *block = direct_alloc(size, ALIGNMENT);
+            if (!block) {
+                break;
+            }
+            out[done++] = block_payload(block);
+        }
+        return done;
+    }
+
+    // One lock round trip for the whole batch
+    heap_t *heap = current_heap();
+    heap_lock(heap);
+    remote_drain(heap);
+    if (size <= SLAB_MAX_SIZE) {
+        while (done < n && (out[done] = slab_alloc(heap, size))) {
+            done++;
+        }
+    } else {
+        done = heap_malloc_batch(heap, size, n, out);
+    }
+    heap_unlock(heap);
+
+    return done;
+}
+
+size_t my_malloc_batch(size_t size, size_t n, void **out) {
+    size_t done = do_malloc_batch(size, n, out);
+    count_mallocs(size, done);
+    for (size_t i = 0; i < done; i++) {
+        trace(TRACE_MALLOC, size, out[i], 0);
+    }
+    return done;
+}
+
+// Pointers that name physically consecutive blocks (as a batch from
+// my_malloc_batch does, in the order it returned them) are joined into one
+// block, which goes through coalesce() once. The calling thread's arena is
+// locked once per stretch of its pointers; objects of other arenas still go
+// to their remote queues. Sorting the pointers first would find more runs,
+// but costs more than the O(1) coalescing it saves.
+void my_free_batch(void **ptrs, size_t n) {
+    size_t freed = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i]) {
+            freed++;
+            trace(TRACE_FREE, 0, ptrs[i], 0);
+        }
+    }
+    count_frees(freed);
+
+    heap_t *locked = NULL;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (!ptr) {
+            continue;
+        }
+
+        chunk_t *chunk = ptr_chunk(ptr);
+        if ((chunk->kind != CHUNK_BLOCKS && chunk->kind != CHUNK_SLABS) || chunk->heap != thread_heap) {
+            if (locked) {
+                heap_unlock(locked);
+                locked = NULL;
+            }
+            do_free(ptr);  // A mapping of its own, or another arena's object
+            continue;
+        }
+
+        check_in_use(ptr);
+        if (prof_sampled(ptr)) {
+            // prof_free takes the arena lock itself
+            if (locked) {
+                heap_unlock(locked);
+                locked = NULL;
+            }
+            prof_free(ptr);
+        }
+        if (!locked) {
+            locked = chunk->heap;
+            heap_lock(locked);
+        }
+        if (chunk->kind == CHUNK_SLABS) {
+            slab_free(locked, ptr);
+            continue;
+        }
+
+        // Absorb the following pointers while they are the next block
+        block_t *first = get_block_ptr(ptr);
+        block_t *last = first;
+        while (i + 1 < n && ptrs[i + 1] == block_payload(next_block(last)) && !prof_sampled(ptrs[i + 1])) {
+            check_in_use(ptrs[i + 1]);
+            last = next_block(last);
+            block_retire(last);
+            locked->stats.coalesces++;
+            i++;
+        }
+        set_block_size(first, (char*)next_block(last) - (char*)block_payload(first));
+        heap_free(locked, first);
+    }
+    if (locked) {
+        heap_unlock(locked);
+    }
+}
+
+// ========== Heap Snapshots ==========
+// A snapshot walks the arenas one chunk at a time: lock the arena, find its
+// n-th chunk, hand each of the chunk's records to a visitor, unlock. The
+// lock is held for one chunk's worth of headers at most, however big the
+// heap is, and nothing is printed or allocated while it is held. Finding
+// the n-th chunk again after the unlock is a walk down a list of chunks
+// (only a few per MB of heap), so chunks coming and going meanwhile shift
+// the count instead of leaving a dangling pointer.
+
+typedef void (*snapshot_visit_t)(void *ctx, const heap_record_t *rec);
+
+static uint32_t snapshot_size(size_t size) {
+    return size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+}
+
+// Report the blocks or slabs of one chunk (lock held)
+static void snapshot_chunk(chunk_t *chunk, unsigned int arena, snapshot_visit_t visit, void *ctx) {
+    heap_record_t rec = { .arena = (uint8_t)arena };
+
+    if (chunk->kind == CHUNK_BLOCKS) {
+        rec.kind = SNAPSHOT_BLOCK;
+        for (block_t *block = chunk_first_block(chunk); block != chunk->epilogue; block = next_block(block)) {
+            rec.addr = (uintptr_t)block;
+            rec.size = snapshot_size(block_size(block));
+            rec.used = !block_is_free(block);
+            visit(ctx, &rec);
+        }
+        return;
+    }
+
+    rec.kind = SNAPSHOT_SLAB;
+    for (size_t page = 1; page < CHUNK_PAGES; page++) {
+        if (chunk->free_pages[page / 64] & (1ULL << (page % 64))) {
+            continue;
+        }
+        slab_t *slab = (slab_t*)((char*)chunk + page * SLAB_SIZE);
+        rec.addr = (uintptr_t)slab;
+        rec.size = slab->obj_size;
+        rec.used = (uint16_t)slab->used;
+        visit(ctx, &rec);
+    }
+}
+
+static chunk_t *nth_chunk(chunk_t *chunk, size_t n) {
+    while (chunk && n--) {
+        chunk = chunk->next;
+    }
+    return chunk;
+}
+
+static void heap_snapshot(snapshot_visit_t visit, void *ctx) {
+    pthread_once(&heaps_once, heaps_init);
+
+    for (unsigned int i = 0; i < heap_count; i++) {
+        heap_t *heap = &heaps[i];
+        for (int slabs = 0; slabs < 2; slabs++) {
+            for (size_t n = 0; ; n++) {
+                heap_lock(heap);
+                if (!slabs && !n) {
+                    remote_drain(heap);  // Show queued remote frees as free
+                }
+                chunk_t *chunk = nth_chunk(slabs ? heap->slab_chunks : heap->chunks, n);
+                if (chunk) {
+                    snapshot_chunk(chunk, i, visit, ctx);
+                }
+                heap_unlock(heap);
+                if (!chunk) {
+                    break;
+                }
+            }
+        }
+    }
+
+    // One record per mapping, so the whole list is quick
+    pthread_mutex_lock(&direct_lock);
+    for (chunk_t *chunk = direct_chunks; chunk; chunk = chunk->next) {
+        heap_record_t rec = {
+            .addr = (uintptr_t)chunk->block,
+            .size = snapshot_size(block_size(chunk->block)),
+            .used = 1,
+            .arena = SNAPSHOT_NO_ARENA,
+            .kind = SNAPSHOT_DIRECT,
+        };
+        visit(ctx, &rec);
+    }
+    pthread_mutex_unlock(&direct_lock);
+}
+
+typedef struct {
+    heap_record_t *records;
+    size_t max;
+    size_t count;
+} snapshot_buf_t;
+
+static void snapshot_store(void *ctx, const heap_record_t *rec) {
+    snapshot_buf_t *buf = ctx;
+    if (buf->count < buf->max) {
+        buf->records[buf->count] = *rec;
+    }
+    buf->count++;
+}
+
+size_t my_malloc_snapshot(heap_record_t *records, size_t max) {
+    snapshot_buf_t buf = { .records = records, .max = max };
+    heap_snapshot(snapshot_store, &buf);
+    return buf.count;
+}
+
+static void snapshot_count(void *ctx, const heap_record_t *rec) {
+    heap_histogram_t *hist = ctx;
+    size_t cls = stat_class(rec->size);
+
+    if (rec->kind == SNAPSHOT_SLAB) {
+        hist->slab_used[cls] += rec->used;
+        hist->slab_slots[cls] += (SLAB_SIZE - SLAB_HEADER_SIZE) / rec->size;
+    } else if (rec->used) {
+        hist->used_blocks[cls]++;
+        hist->used_bytes[cls] += rec->size;
+    } else {
+        hist->free_blocks[cls]++;
+        hist->free_bytes[cls] += rec->size;
+    }
+}
+
+void my_malloc_histogram(heap_histogram_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+    heap_snapshot(snapshot_count, hist);
+}
+
+// Take a snapshot into pages mapped for it, behind room for the file header
+// (the heap may be what is being debugged, so it isn't used). Retries until
+// the buffer is big enough; returns the mapping, or NULL.
+static heap_snapshot_header_t *snapshot_map(size_t *map_size) {
+    size_t count = my_malloc_snapshot(NULL, 0);
+    for (;;) {
+        size_t max = count + count / 8 + 64;  // Room for some growth meanwhile
+        *map_size = page_round(sizeof(heap_snapshot_header_t) + max * sizeof(heap_record_t));
+        heap_snapshot_header_t *header = os_map(*map_size);
+        if (!header) {
+            return NULL;
+        }
+        count = my_malloc_snapshot((heap_record_t*)(header + 1), max);
+        if (count <= max) {
+            memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+            header->chunk_size = CHUNK_SIZE;
+            header->slab_size = SLAB_SIZE;
+            header->header_size = BLOCK_SIZE;
+            header->record_size = sizeof(heap_record_t);
+            header->count = count;
+            return header;
+        }
+        os_unmap(header, *map_size);
+    }
+}
+
+int my_malloc_snapshot_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t map_size;
+    heap_snapshot_header_t *header = snapshot_map(&map_size);
+    if (!header) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    const char *data = (const char*)header;
+    size_t len = sizeof(*header) + header->count * sizeof(heap_record_t);
+    int failed = 0;
+    for (size_t done = 0; done < len && !failed; ) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno != EINTR) {
+            failed = 1;
+        } else if (n > 0) {
+            done += n;
+        }
+    }
+    os_unmap(header, map_size);
+
+    if (close(fd) != 0 || failed) {
+        return -1;
+    }
+    return 0;
+}
+
+// ========== Debug/Visualization Functions ==========
+
+// Is the object parked in the calling thread's cache?
+static int tcache_contains(void *ptr, size_t size) {
+    if (size > TCACHE_MAX_SIZE) {
+        return 0;
+    }
+    for (free_node_t *cached = tcache.bins[bin_index(size)]; cached;
+         cached = cache_link(&cached->next, cached->next)) {
+        if ((void*)cached == ptr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One line per slab class in use: slots handed out (cached ones included)
+// out of all slots in the arena's slabs of that class
+static void print_slabs(const heap_record_t *records, size_t count) {
+    unsigned int used[NUM_SLAB_CLASSES] = {0};
+    unsigned int slots[NUM_SLAB_CLASSES] = {0};
+    unsigned int slabs[NUM_SLAB_CLASSES] = {0};
+
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].kind == SNAPSHOT_SLAB) {
+            size_t cls = bin_index(records[i].size);
+            used[cls] += records[i].used;
+            slots[cls] += (SLAB_SIZE - SLAB_HEADER_SIZE) / records[i].size;
+            slabs[cls]++;
+        }
+    }
+
+    for (size_t cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+        if (slabs[cls]) {
+            printf("Slab class %zu bytes: %u/%u slots used in %u slab%s\n",
+                   (cls + 1) * ALIGNMENT, used[cls], slots[cls], slabs[cls],
+                   slabs[cls] == 1 ? "" : "s");
+        }
+    }
+}
+
+void print_memory_map(void) {
+    size_t map_size;
+    heap_snapshot_header_t *header = snapshot_map(&map_size);
+    if (!header) {
+        printf("\n=== Memory Map: out of memory ===\n\n");
+        return;
+    }
+
+    heap_record_t *records = (heap_record_t*)(header + 1);
+    size_t count = header->count;
+    int block_num = 0;
+
+    printf("\n=== Memory Map ===\n");
+    for (size_t i = 0; i < count; ) {
+        unsigned int arena = records[i].arena;
+        size_t end = i;
+        while (end < count && records[end].arena == arena) {
+            end++;
+        }
+
+        if (arena == SNAPSHOT_NO_ARENA) {
+            printf("Direct mappings:\n");
+        } else {
+            printf("Arena %u:\n", arena);
+            print_slabs(records + i, end - i);
+        }
+        for (; i < end; i++) {
+            heap_record_t *rec = &records[i];
+            block_t *block = (block_t*)(uintptr_t)rec->addr;
+            if (rec->kind == SNAPSHOT_SLAB) {
+                continue;
+            }
+            printf("Block %d: [%s] size=%zu bytes, addr=%p\n",
+                   block_num++,
+                   rec->kind == SNAPSHOT_DIRECT ? "MMAP"
+                       : !rec->used ? "FREE"
+                       : tcache_contains(block_payload(block), rec->size) ? "CACHED" : "USED",
+                   (size_t)rec->size,
+                   (void*)block);
+        }
+    }
+    printf("==================\n\n");
+
+    os_unmap(header, map_size);
+}
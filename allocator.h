@@ -0,0 +1,366 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ========== Public API ==========
+
+void *my_malloc(size_t size);
+void my_free(void *ptr);
+void *my_realloc(void *ptr, size_t size);
+// nmemb * size zeroed bytes (NULL with errno set if the product overflows).
+// Memory that is still as the kernel mapped it is not cleared again, so
+// large zeroed buffers are only faulted in as they are used.
+void *my_calloc(size_t nmemb, size_t size);
+
+// Free with a known size: anything from the size originally requested up to
+// my_malloc_usable_size(ptr). Skips looking up the object's size class.
+void my_free_sized(void *ptr, size_t size);
+// Bytes actually available at ptr (at least what was requested), all of
+// which the caller may use without calling my_realloc
+size_t my_malloc_usable_size(void *ptr);
+
+// ========== Aligned Allocation ==========
+
+// Memory whose address is a multiple of `alignment` (a power of two; up to
+// 512 KiB), released with my_free. my_memalign and my_aligned_alloc return
+// NULL and set errno on failure; my_posix_memalign returns the error code
+// and requires alignment to be a multiple of sizeof(void *).
+void *my_memalign(size_t alignment, size_t size);
+void *my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+// ========== Arena Binding ==========
+
+// How a thread picks its arena (independent heap with its own lock)
+typedef enum {
+    ARENA_ROUND_ROBIN,  // Threads are spread over the arenas in creation order
+    ARENA_PER_CPU,      // Threads use the arena of the CPU they are running on
+    ARENA_PER_NODE      // Threads use an arena of the NUMA node they are running on,
+                        // and arenas place their memory on their own node
+} arena_policy_t;
+
+void my_malloc_set_arena_policy(arena_policy_t policy);
+
+// ========== Fit Strategy ==========
+
+// How an arena picks among the free blocks that can hold a request. Only
+// requests above 512 bytes can differ: smaller ones have a bin per size.
+typedef enum {
+    FIT_BEST,   // (Close to) the smallest block that fits, in bounded time; the default
+    FIT_FIRST,  // The first block that fits, scanning from the front of its bin
+    FIT_NEXT    // First fit, but each scan resumes where the last one left off
+} fit_strategy_t;
+
+// Switch every arena to `strategy`, effective from the next allocation.
+// Building the allocator with -DFIRST_FIT makes FIT_FIRST the default.
+void my_malloc_set_strategy(fit_strategy_t strategy);
+
+// ========== Large Allocations ==========
+
+// Requests of at least this many bytes (default 128 KiB) get their own mmap()
+// mapping, which free() unmaps immediately. Capped at what a 1 MiB arena
+// chunk can hold.
+void my_malloc_set_mmap_threshold(size_t threshold);
+
+// Non-zero maps arena chunks two at a time, as 2 MiB regions backed by huge
+// pages: transparent huge pages where the kernel has them enabled, else
+// the hugetlbfs pool, else plain pages as before. Fewer TLB misses for big
+// heaps, at the cost of releasing memory in whole regions only: the pages
+// inside free blocks of such regions are never dropped, and my_malloc_trim
+// unmaps a region once both of its halves are free. Off by default.
+void my_malloc_set_huge_pages(int enable);
+
+// ========== Returning Memory ==========
+
+// Give free memory back to the OS now: completely free arena chunks are
+// unmapped (except for about `pad` bytes of them per arena, kept for reuse)
+// and the pages inside large free blocks are dropped with madvise().
+// Returns 1 if any memory was released, 0 otherwise.
+int my_malloc_trim(size_t pad);
+
+// Pages of large free blocks that stay unused for decay_ms milliseconds
+// (default 1000) are released automatically, amortized over free() calls.
+// A negative value turns the automatic purger off.
+void my_malloc_set_decay(long decay_ms);
+
+// ========== Deferred Coalescing ==========
+
+// By default a freed block is merged with its free neighbours right away.
+// With a non-zero limit, freed arena blocks of up to 2 KiB that don't go to
+// a thread cache are parked unmerged in per-arena fastbins instead, and a
+// request they fit takes one straight back. Everything parked is merged in
+// one pass when an allocation finds nothing else that fits, when an
+// arena's fastbins hold more than `limit` bytes, or on my_malloc_trim.
+// That makes most frees and reallocations of recently freed sizes cheaper,
+// in exchange for more fragmentation and a longer free now and then (the
+// pass), so latency-sensitive programs may want to keep the default of 0.
+void my_malloc_set_fastbin_limit(size_t limit);
+
+// ========== Hardened Mode ==========
+
+// Built with -DHARDENED (make libmyalloc_hardened.so), the allocator checks
+// block canaries, catches double frees and corrupted free lists, and aborts
+// with a message on stderr when it finds heap corruption. On top of that,
+// about one allocation in `rate` below the mmap threshold can be placed
+// right in front of an inaccessible guard page, and made inaccessible
+// itself once freed, so an overflow or a use after free of it faults where
+// it happens. 0 (the default) turns that off; ordinary builds ignore it.
+void my_malloc_set_guard_sample(unsigned int rate);
+
+// ========== Batch Allocation ==========
+
+// Allocate n objects of `size` bytes each into out[] with a single lock
+// round trip; mid-sized ones are carved back to back from one free region.
+// Returns how many were allocated (fewer than n only if memory ran out).
+size_t my_malloc_batch(size_t size, size_t n, void **out);
+// Free n pointers (NULLs are skipped) with as few lock round trips as
+// possible. Runs of neighbouring blocks in address order, such as a batch
+// from my_malloc_batch, are merged before they are coalesced with the heap.
+void my_free_batch(void **ptrs, size_t n);
+
+// ========== Statistics ==========
+
+// Size classes of the per-class counters: entry k covers sizes from 2^k to
+// 2^(k+1) - 1 bytes
+#define MALLOC_STAT_CLASSES 48
+
+typedef struct {
+    size_t allocated;       // Bytes in blocks, slab slots and direct mappings handed out
+                            // (objects parked in thread caches included)
+    size_t mapped;          // Bytes mapped from the OS
+    size_t free;            // Bytes in free arena blocks, headers included (parked ones too)
+    size_t chunks;          // Arena chunks currently mapped (blocks and slabs)
+    size_t direct;          // Live direct mappings
+    size_t huge_chunks;     // Arena chunks in huge-page regions (see my_malloc_set_huge_pages)
+    double fragmentation;   // 1 - largest free block / all free block bytes (0 = none)
+
+    uint64_t request_space; // Arena chunks mapped for blocks so far
+    uint64_t splits;        // Blocks split off a larger free block
+    uint64_t coalesces;     // Merges of two neighbouring free blocks
+    uint64_t consolidations; // Passes merging parked blocks (see my_malloc_set_fastbin_limit)
+    uint64_t remote_frees;  // Objects freed by a thread of another arena, once their owner took them
+
+    uint64_t lock_acquired; // Times an arena lock was taken
+    uint64_t lock_contended; // ... while another thread held it
+    uint64_t lock_wait_ns;  // Total time spent waiting for arena locks
+    uint64_t lock_hold_ns;  // Total time arena locks were held (estimated from one hold in 64)
+
+    uint64_t mallocs;       // Calls to malloc, calloc and memalign (each batch object counts)
+    uint64_t frees;
+    uint64_t reallocs;
+    uint64_t tcache_hits;   // Allocations served by a thread cache without a lock
+    uint64_t node_local;    // NUMA machines: allocation calls while the caller's arena was
+    uint64_t node_remote;   // on its node, or on another one (as of its last arena pick)
+
+    uint64_t mallocs_by_class[MALLOC_STAT_CLASSES];   // Allocation calls by requested size
+    size_t free_blocks_by_class[MALLOC_STAT_CLASSES]; // Free-list lengths by block size
+} malloc_stats_t;
+
+// Snapshot of the counters. Call counts are kept per thread without atomic
+// instructions and summed here, so they may lag a call or two behind.
+void my_malloc_stats(malloc_stats_t *stats);
+
+// mallctl-style access by name, for metrics exporters: "stats.<field>" reads
+// a malloc_stats_t field (the *_by_class arrays whole), "arenas.count" and
+// "arenas.nodes" the number of arenas and of NUMA nodes (unsigned int), and
+// "opt.mmap_threshold" (size_t), "opt.decay_ms" (long), "opt.fastbin_limit"
+// (size_t), "opt.huge_pages" (int), "opt.guard_sample" (unsigned int),
+// "opt.strategy" (fit_strategy_t) and "opt.arena_policy" (arena_policy_t)
+// read and set the tunables above.
+// The current value is copied to oldp when *oldlenp matches its size (with
+// oldp NULL, *oldlenp is set to the size instead); a new one is read from
+// newp. Returns 0, ENOENT for an unknown name, EINVAL for a size mismatch,
+// or EPERM for writing a read-only value.
+int my_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
+// ========== Tracing ==========
+
+// While a trace is running, every call to the allocation functions above
+// (and the aligned and batch variants) appends a record to the trace file.
+// The file starts with the 8 bytes of TRACE_MAGIC and holds one record per
+// call, in the order the calls returned. Replay it with bench/trace_replay.c.
+#define TRACE_MAGIC "MYALTRC1"
+
+typedef enum {
+    TRACE_MALLOC,
+    TRACE_CALLOC,
+    TRACE_MEMALIGN,
+    TRACE_REALLOC,
+    TRACE_FREE
+} trace_op_t;
+
+typedef struct {
+    uint64_t time_ns;  // Since the trace started
+    uint64_t size;     // Bytes requested (calloc: nmemb * size; free: 0)
+    uint64_t id;       // Object returned or, for free, released (its address)
+    uint64_t arg;      // Realloc: the object passed in; memalign: the alignment
+    uint32_t thread;   // Calling thread, numbered from 1 in order of its first call
+    uint32_t op;       // trace_op_t
+} trace_record_t;
+
+// Start writing a trace to `path` (created or truncated); returns 0, or -1
+// with errno set. The drop-in library starts one when the environment
+// variable MYALLOC_TRACE names a file.
+int my_malloc_trace_start(const char *path);
+// Flush and close the trace
+void my_malloc_trace_stop(void);
+
+// ========== Heap Profiling ==========
+
+// Start sampling allocations (malloc, calloc and realloc) about once every
+// sample_bytes bytes allocated (0 picks 512 KiB), recording the stack of
+// each sampled one. Returns 0, or -1 with errno set if the tables can't be
+// mapped. Threads notice within sample_bytes of their next allocations.
+int my_malloc_prof_start(size_t sample_bytes);
+
+// Stop taking samples; what was recorded so far is kept for dumping
+void my_malloc_prof_stop(void);
+
+// Write the live and cumulative profile in pprof's legacy heap format:
+//   go tool pprof -inuse_space ./program heap.prof   (what is live now)
+//   go tool pprof -alloc_space ./program heap.prof   (everything sampled)
+// Returns 0, or -1 with errno set.
+int my_malloc_prof_dump(const char *path);
+
+// ========== Heap Snapshots ==========
+
+// The layout of the heap, one record per arena block, slab page and direct
+// mapping. The walk locks one arena chunk at a time, so other threads keep
+// allocating while it runs: every chunk is seen in a consistent state, but
+// chunks mapped or trimmed meanwhile may be missed or seen twice.
+typedef enum {
+    SNAPSHOT_BLOCK,   // A block of an arena chunk
+    SNAPSHOT_SLAB,    // A slab page of an arena chunk
+    SNAPSHOT_DIRECT   // A direct mapping
+} snapshot_kind_t;
+
+#define SNAPSHOT_NO_ARENA 255
+
+typedef struct {
+    uint64_t addr;    // Block header; slab: page; direct: the mapping's block header
+    uint32_t size;    // Payload bytes (4 GiB and up read as UINT32_MAX); slab: slot size
+    uint16_t used;    // 1 if handed out (thread caches and fastbins count as handed
+                      // out), 0 if free; slab: slots handed out
+    uint8_t arena;    // Owning arena, SNAPSHOT_NO_ARENA for a direct mapping
+    uint8_t kind;     // snapshot_kind_t
+} heap_record_t;
+
+// Fill records[0..max) with the heap's records, arena by arena and in
+// address order within a chunk. Returns how many there were, which may be
+// more than max (only max are stored); a NULL buffer with max 0 just counts.
+size_t my_malloc_snapshot(heap_record_t *records, size_t max);
+
+// What the same walk counts by size class (see MALLOC_STAT_CLASSES), without
+// storing any records: cheap enough to poll
+typedef struct {
+    size_t used_blocks[MALLOC_STAT_CLASSES];  // Arena blocks and direct mappings handed out
+    size_t used_bytes[MALLOC_STAT_CLASSES];
+    size_t free_blocks[MALLOC_STAT_CLASSES];  // Free arena blocks
+    size_t free_bytes[MALLOC_STAT_CLASSES];
+    size_t slab_used[MALLOC_STAT_CLASSES];    // Slab slots handed out, by slot size
+    size_t slab_slots[MALLOC_STAT_CLASSES];   // All slots of the slabs in use
+} heap_histogram_t;
+
+void my_malloc_histogram(heap_histogram_t *hist);
+
+// A snapshot written to a file: this header, then `count` records. Render it
+// with bench/heap_heatmap.c.
+#define SNAPSHOT_MAGIC "MYALSNP1"
+
+typedef struct {
+    char magic[8];          // SNAPSHOT_MAGIC
+    uint32_t chunk_size;    // Arena chunk size: addr & ~(chunk_size - 1) is a record's chunk
+    uint32_t slab_size;     // Bytes per slab page
+    uint32_t header_size;   // Block overhead: a block spans header_size + size bytes from addr
+    uint32_t record_size;   // sizeof(heap_record_t)
+    uint64_t count;         // Records that follow
+} heap_snapshot_header_t;
+
+// Write a snapshot to `path` (created or truncated); returns 0, or -1 with
+// errno set
+int my_malloc_snapshot_dump(const char *path);
+
+// ========== Regions ==========
+
+// A region (bump-pointer arena) carves objects out of large chunks taken
+// from the main heap and frees them all at once. Objects are aligned to 16
+// bytes and are never passed to my_free.
+typedef struct arena arena_t;
+
+// Position of a region's cursor, for rewinding scratch allocations
+typedef struct {
+    void *chunk;
+    size_t used;
+} arena_checkpoint_t;
+
+// chunk_size is the size of the chunks requested from the heap (0 for the
+// default of 64 KiB); larger objects get a chunk of their own
+arena_t *arena_create(size_t chunk_size);
+void *arena_alloc(arena_t *arena, size_t size);
+// Free every object in O(1); the chunks are kept for reuse
+void arena_reset(arena_t *arena);
+// Free everything allocated since the checkpoint was taken. Checkpoints nest:
+// restoring one invalidates those taken after it.
+arena_checkpoint_t arena_save(arena_t *arena);
+void arena_restore(arena_t *arena, arena_checkpoint_t checkpoint);
+// Give all chunks back to the heap
+void arena_destroy(arena_t *arena);
+
+// ========== Persistent Heaps ==========
+
+// A persistent heap lives in a file mapped into memory, so its objects
+// survive the process: a later pheap_open of the same file finds them as
+// they were, even if the file is mapped at another address. The root object
+// is where a program starts looking for its data again. Objects are aligned
+// to 16 bytes and freed with pheap_free, never my_free. Only one process
+// may have a heap open at a time; its threads can share it.
+typedef struct pheap pheap_t;
+
+// Pointers stored inside a persistent heap must be self-relative: a
+// pheap_ref_t holds the distance from itself to its target (0 for NULL),
+// which stays right wherever the heap is mapped
+typedef struct {
+    int64_t offset;
+} pheap_ref_t;
+
+void pheap_ref_set(pheap_ref_t *ref, const void *target);
+void *pheap_ref_get(const pheap_ref_t *ref);
+
+// Open the heap in `path`, creating an empty one if the file is empty or
+// missing. max_size is the most the file may grow to (0 for 1 GiB); that
+// much address space is reserved up front. NULL with errno set on failure:
+// EINVAL for a file that is not a heap, EWOULDBLOCK if another process has
+// it open, and EUCLEAN if the last process to open it never closed it (and
+// may have died halfway through an update), in which case the heap should
+// be discarded and rebuilt.
+pheap_t *pheap_open(const char *path, size_t max_size);
+// Write everything out and unmap the heap; 0 on success
+int pheap_close(pheap_t *heap);
+// Write everything out without closing (msync); 0 on success
+int pheap_sync(pheap_t *heap);
+
+void *pheap_alloc(pheap_t *heap, size_t size);
+void pheap_free(pheap_t *heap, void *ptr);
+size_t pheap_usable_size(pheap_t *heap, void *ptr);
+
+// The object a program uses to find its data after reopening (NULL in a new
+// heap)
+void *pheap_root(pheap_t *heap);
+void pheap_set_root(pheap_t *heap, void *ptr);
+
+// ========== Debug/Visualization Functions ==========
+
+// Print a snapshot of the heap (see my_malloc_snapshot), one line per block
+void print_memory_map(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,582 @@
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+// ========== C++ Front End ==========
+// A header-only C++17 layer for building heaps specialized for one
+// subsystem, with the policies fixed at compile time:
+//
+//   myalloc::Allocator<FitPolicy, SizeClasses, Alignment, LockPolicy>
+//
+// Each instance is a private heap built from the same primitives as the C
+// allocator: blocks with a size-and-flags header, boundary tags on free
+// blocks so neighbours coalesce in O(1), and segregated free lists over
+// chunks it takes from the main heap with my_memalign. Only the code of the
+// chosen policies is compiled in: a heap with NoLock has no lock calls, and
+// one with FixedSize classes is a plain slot list with no headers, splitting
+// or coalescing at all. Chunks are only given back when the heap is
+// destroyed.
+//
+// The adapters at the end let standard containers use either the main heap
+// (MallocAllocator, MallocResource) or an instance (HeapAllocator,
+// HeapResource).
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+
+#include "allocator.h"
+
+namespace myalloc {
+
+namespace detail {
+
+constexpr std::size_t align_up(std::size_t size, std::size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+constexpr bool is_pow2(std::size_t x) {
+    return x && !(x & (x - 1));
+}
+
+constexpr unsigned floor_log2(std::size_t x) {
+    return std::numeric_limits<std::size_t>::digits - 1 - __builtin_clzl(x);
+}
+
+}  // namespace detail
+
+// ========== Lock Policies ==========
+
+// For a heap only ever used by one thread
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+};
+
+// For a heap shared between threads
+struct MutexLock {
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+    std::mutex mutex;
+};
+
+// ========== Size Classes ==========
+// A size-class policy maps a request size (already aligned) to one of
+// `count` free lists. Every block on a higher list than a request's must
+// fit it, so a fit policy only searches the request's own list and
+// otherwise takes the first block of the next non-empty one.
+
+// One list per Step bytes up to Max (a power of two), one per power of two above
+template <std::size_t Max = 512, std::size_t Step = 16>
+struct ExactClasses {
+    static_assert(detail::is_pow2(Max) && Step && Max % Step == 0,
+                  "Max must be a power of two and a multiple of Step");
+    static constexpr bool fixed = false;
+    static constexpr std::size_t exact = Max / Step;
+    static constexpr std::size_t count =
+        exact + std::numeric_limits<std::size_t>::digits - detail::floor_log2(Max);
+
+    static constexpr std::size_t index(std::size_t size) {
+        return size <= Max ? (size - 1) / Step
+                           : exact + detail::floor_log2(size) - detail::floor_log2(Max);
+    }
+};
+
+// One list per power of two
+struct Log2Classes {
+    static constexpr bool fixed = false;
+    static constexpr std::size_t count = std::numeric_limits<std::size_t>::digits;
+
+    static constexpr std::size_t index(std::size_t size) {
+        return detail::floor_log2(size);
+    }
+};
+
+// Every object is Size bytes or less: the heap hands out equal slots and
+// refuses anything larger
+template <std::size_t Size>
+struct FixedSize {
+    static_assert(Size > 0, "Size must not be 0");
+    static constexpr bool fixed = true;
+    static constexpr std::size_t size = Size;
+    static constexpr std::size_t count = 1;
+
+    static constexpr std::size_t index(std::size_t) {
+        return 0;
+    }
+};
+
+// ========== Fit Policies ==========
+// Which block of a request's own free list to take (NULL if none fits)
+
+// The first one that fits
+struct FirstFit {
+    template <class Block>
+    static Block *find(Block *list, std::size_t size) {
+        while (list && list->size() < size) {
+            list = list->next_free;
+        }
+        return list;
+    }
+};
+
+// The smallest one that fits, stopping early at an exact fit
+struct BestFit {
+    template <class Block>
+    static Block *find(Block *list, std::size_t size) {
+        Block *best = nullptr;
+        for (; list; list = list->next_free) {
+            if (list->size() >= size && (!best || list->size() < best->size())) {
+                best = list;
+                if (best->size() == size) {
+                    break;
+                }
+            }
+        }
+        return best;
+    }
+};
+
+// ========== Heap ==========
+
+template <class FitPolicy = BestFit, class SizeClasses = ExactClasses<>,
+          std::size_t Alignment = 16, class LockPolicy = MutexLock>
+class Allocator {
+    static_assert(detail::is_pow2(Alignment) && Alignment >= sizeof(void*),
+                  "Alignment must be a power of two of at least sizeof(void *)");
+
+public:
+    static constexpr std::size_t alignment = Alignment;
+    static constexpr std::size_t default_chunk_size = 64 * 1024;
+
+    // chunk_size is the size of the chunks requested from the main heap (0
+    // for the default); larger objects get a chunk of their own
+    explicit Allocator(std::size_t chunk_size = 0)
+        : chunk_size_(chunk_size ? chunk_size : default_chunk_size) {}
+
+    Allocator(const Allocator &) = delete;
+    Allocator &operator=(const Allocator &) = delete;
+
+    // Give all chunks back to the main heap, whatever is still allocated
+    ~Allocator() {
+        while (chunks_) {
+            Chunk *next = chunks_->next;
+            my_free(chunks_);
+            chunks_ = next;
+        }
+    }
+
+    // Alignment-aligned memory for size bytes, or NULL if none can be had
+    // (or, with FixedSize classes, if size is more than a slot)
+    void *allocate(std::size_t size) {
+        std::lock_guard<LockPolicy> guard(lock_);
+        if constexpr (SizeClasses::fixed) {
+            return size <= SizeClasses::size ? take_slot() : nullptr;
+        } else {
+            return take_block(size);
+        }
+    }
+
+    void deallocate(void *ptr) {
+        if (!ptr) {
+            return;
+        }
+        std::lock_guard<LockPolicy> guard(lock_);
+        if constexpr (SizeClasses::fixed) {
+            Slot *slot = static_cast<Slot*>(ptr);
+            slot->next = free_slots_;
+            free_slots_ = slot;
+        } else {
+            insert(coalesce(block_of(ptr)));
+        }
+    }
+
+    // Bytes available at ptr (at least what was requested)
+    std::size_t usable_size(void *ptr) const {
+        if constexpr (SizeClasses::fixed) {
+            return ptr ? slot_size : 0;
+        } else {
+            return ptr ? block_of(ptr)->size() : 0;
+        }
+    }
+
+private:
+    // ========== Chunks ==========
+
+    struct Chunk {
+        Chunk *next;
+    };
+
+    Chunk *new_chunk(std::size_t bytes) {
+        Chunk *chunk = static_cast<Chunk*>(my_memalign(Alignment, bytes));
+        if (chunk) {
+            chunk->next = chunks_;
+            chunks_ = chunk;
+        }
+        return chunk;
+    }
+
+    // ========== Slots (FixedSize classes) ==========
+
+    struct Slot {
+        Slot *next;
+    };
+
+    static constexpr std::size_t slot_size = [] {
+        if constexpr (SizeClasses::fixed) {
+            return detail::align_up(SizeClasses::size > sizeof(Slot) ? SizeClasses::size : sizeof(Slot), Alignment);
+        } else {
+            return std::size_t(0);
+        }
+    }();
+    static constexpr std::size_t chunk_header = detail::align_up(sizeof(Chunk), Alignment);
+
+    // Freed slots first, then the untouched tail of the newest chunk
+    void *take_slot() {
+        if (free_slots_) {
+            Slot *slot = free_slots_;
+            free_slots_ = slot->next;
+            return slot;
+        }
+        if (bump_ == bump_end_) {
+            std::size_t bytes = chunk_size_ < chunk_header + slot_size ? chunk_header + slot_size : chunk_size_;
+            char *chunk = reinterpret_cast<char*>(new_chunk(bytes));
+            if (!chunk) {
+                return nullptr;
+            }
+            bump_ = chunk + chunk_header;
+            bump_end_ = bump_ + (bytes - chunk_header) / slot_size * slot_size;
+        }
+        void *ptr = bump_;
+        bump_ += slot_size;
+        return ptr;
+    }
+
+    // ========== Blocks ==========
+    // The layout of the C allocator's blocks: the header holds the payload
+    // size and the flags below, a free block keeps its list links at the
+    // start of its payload and its size in the last word of it, and the
+    // PREV_INUSE bit says whether the block before has such a tag. Each
+    // chunk ends in a zero-sized in-use header so the last block has a
+    // neighbour to update.
+
+    struct Block {
+        std::size_t header;
+        Block *next_free;
+        Block *prev_free;
+
+        std::size_t size() const { return header & ~(Alignment - 1); }
+    };
+
+    static constexpr std::size_t FREE = 1;
+    static constexpr std::size_t PREV_INUSE = 2;
+
+    static constexpr std::size_t header_size = detail::align_up(sizeof(std::size_t), Alignment);
+    // Room for the list links and the trailing size
+    static constexpr std::size_t min_payload =
+        sizeof(Block) + sizeof(std::size_t) > header_size
+            ? detail::align_up(sizeof(Block) + sizeof(std::size_t) - header_size, Alignment)
+            : Alignment;
+    // The first block of a chunk, placed so its payload is aligned
+    static constexpr std::size_t first_block = detail::align_up(sizeof(Chunk) + header_size, Alignment) - header_size;
+    static constexpr std::size_t words = (SizeClasses::count + 63) / 64;
+
+    static char *payload(Block *block) {
+        return reinterpret_cast<char*>(block) + header_size;
+    }
+
+    static Block *block_of(void *ptr) {
+        return reinterpret_cast<Block*>(static_cast<char*>(ptr) - header_size);
+    }
+
+    static Block *next_block(Block *block) {
+        return reinterpret_cast<Block*>(payload(block) + block->size());
+    }
+
+    // The block before, if it is free
+    static Block *prev_block(Block *block) {
+        if (block->header & PREV_INUSE) {
+            return nullptr;
+        }
+        std::size_t size = *reinterpret_cast<std::size_t*>(reinterpret_cast<char*>(block) - sizeof(std::size_t));
+        return reinterpret_cast<Block*>(reinterpret_cast<char*>(block) - header_size - size);
+    }
+
+    static void set_free(Block *block) {
+        block->header |= FREE;
+        *reinterpret_cast<std::size_t*>(payload(block) + block->size() - sizeof(std::size_t)) = block->size();
+        next_block(block)->header &= ~PREV_INUSE;
+    }
+
+    static void set_used(Block *block) {
+        block->header &= ~FREE;
+        next_block(block)->header |= PREV_INUSE;
+    }
+
+    void insert(Block *block) {
+        std::size_t index = SizeClasses::index(block->size());
+        block->prev_free = nullptr;
+        block->next_free = bins_[index];
+        if (block->next_free) {
+            block->next_free->prev_free = block;
+        }
+        bins_[index] = block;
+        map_[index / 64] |= std::uint64_t(1) << (index % 64);
+    }
+
+    void remove(Block *block) {
+        std::size_t index = SizeClasses::index(block->size());
+        if (block->prev_free) {
+            block->prev_free->next_free = block->next_free;
+        } else {
+            bins_[index] = block->next_free;
+            if (!bins_[index]) {
+                map_[index / 64] &= ~(std::uint64_t(1) << (index % 64));
+            }
+        }
+        if (block->next_free) {
+            block->next_free->prev_free = block->prev_free;
+        }
+    }
+
+    // Mark a block free and merge it with its free neighbours
+    Block *coalesce(Block *block) {
+        Block *next = next_block(block);
+        if (next->header & FREE) {
+            remove(next);
+            block->header += header_size + next->size();
+        }
+        Block *prev = prev_block(block);
+        if (prev) {
+            remove(prev);
+            prev->header += header_size + block->size();
+            block = prev;
+        }
+        set_free(block);
+        return block;
+    }
+
+    // Give the tail of an in-use block beyond `size` back to the free lists
+    void split(Block *block, std::size_t size) {
+        std::size_t rest = block->size() - size;
+        if (rest < header_size + min_payload) {
+            return;
+        }
+        block->header -= rest;
+        Block *tail = next_block(block);
+        tail->header = (rest - header_size) | PREV_INUSE;
+        insert(coalesce(tail));
+    }
+
+    // A fitting block from the request's own list, else the first block of
+    // the next non-empty list
+    Block *find(std::size_t size) {
+        std::size_t index = SizeClasses::index(size);
+        Block *block = FitPolicy::find(bins_[index], size);
+        if (block) {
+            return block;
+        }
+        for (std::size_t w = (index + 1) / 64; w < words; w++) {
+            std::uint64_t bits = map_[w];
+            if (w == (index + 1) / 64) {
+                bits &= ~std::uint64_t(0) << ((index + 1) % 64);
+            }
+            if (bits) {
+                return bins_[w * 64 + __builtin_ctzll(bits)];
+            }
+        }
+        return nullptr;
+    }
+
+    // A chunk holding one in-use block of at least `size` bytes
+    Block *grow(std::size_t size) {
+        std::size_t bytes = first_block + header_size + size + header_size;
+        if (bytes < chunk_size_) {
+            bytes = chunk_size_ & ~(Alignment - 1);
+        }
+        char *chunk = reinterpret_cast<char*>(new_chunk(bytes));
+        if (!chunk) {
+            return nullptr;
+        }
+        Block *block = reinterpret_cast<Block*>(chunk + first_block);
+        block->header = (bytes - first_block - 2 * header_size) | PREV_INUSE;
+        next_block(block)->header = PREV_INUSE;
+        return block;
+    }
+
+    void *take_block(std::size_t size) {
+        if (size > std::numeric_limits<std::size_t>::max() / 2) {
+            return nullptr;
+        }
+        size = size < min_payload ? min_payload : detail::align_up(size, Alignment);
+        Block *block = find(size);
+        if (block) {
+            remove(block);
+            set_used(block);
+        } else if (!(block = grow(size))) {
+            return nullptr;
+        }
+        split(block, size);
+        return payload(block);
+    }
+
+    LockPolicy lock_;
+    Chunk *chunks_ = nullptr;
+    std::size_t chunk_size_;
+    Block *bins_[SizeClasses::count] = {};
+    std::uint64_t map_[words] = {};     // Bit per non-empty list
+    Slot *free_slots_ = nullptr;
+    char *bump_ = nullptr;
+    char *bump_end_ = nullptr;
+};
+
+// The common specializations: a heap for one thread, and a pool of
+// equal-sized objects for one thread
+using LocalHeap = Allocator<BestFit, ExactClasses<>, 16, NoLock>;
+
+template <std::size_t Size>
+using FixedPool = Allocator<FirstFit, FixedSize<Size>, 16, NoLock>;
+
+// ========== Standard Library Adapters ==========
+
+// A std::allocator replacement on the main heap
+template <class T>
+struct MallocAllocator {
+    using value_type = T;
+
+    MallocAllocator() noexcept = default;
+    template <class U>
+    MallocAllocator(const MallocAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        // my_malloc(0) returns NULL, but allocate(0) must succeed
+        std::size_t bytes = n ? n * sizeof(T) : 1;
+        void *ptr = alignof(T) <= alignof(void*) ? my_malloc(bytes) : my_memalign(alignof(T), bytes);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        my_free(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const MallocAllocator<T> &, const MallocAllocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const MallocAllocator<T> &, const MallocAllocator<U> &) noexcept {
+    return false;
+}
+
+// A std::allocator replacement on an Allocator instance, which must outlive
+// every container using it
+template <class T, class Heap>
+class HeapAllocator {
+    static_assert(alignof(T) <= Heap::alignment, "T is over-aligned for this heap");
+
+public:
+    using value_type = T;
+
+    explicit HeapAllocator(Heap &heap) noexcept : heap_(&heap) {}
+    template <class U>
+    HeapAllocator(const HeapAllocator<U, Heap> &other) noexcept : heap_(other.heap()) {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void *ptr = heap_->allocate(n * sizeof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        heap_->deallocate(ptr);
+    }
+
+    Heap *heap() const noexcept { return heap_; }
+
+private:
+    Heap *heap_;
+};
+
+template <class T, class U, class Heap>
+bool operator==(const HeapAllocator<T, Heap> &a, const HeapAllocator<U, Heap> &b) noexcept {
+    return a.heap() == b.heap();
+}
+
+template <class T, class U, class Heap>
+bool operator!=(const HeapAllocator<T, Heap> &a, const HeapAllocator<U, Heap> &b) noexcept {
+    return a.heap() != b.heap();
+}
+
+// A memory resource on the main heap; all of them are interchangeable
+class MallocResource : public std::pmr::memory_resource {
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *ptr = align <= alignof(void*) ? my_malloc(bytes ? bytes : 1)
+                                            : my_memalign(align, bytes ? bytes : 1);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        my_free(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const MallocResource*>(&other) != nullptr;
+    }
+};
+
+inline MallocResource *malloc_resource() noexcept {
+    static MallocResource resource;
+    return &resource;
+}
+
+// A memory resource on an Allocator instance, which must outlive it. Requests
+// aligned beyond the heap's alignment throw std::bad_alloc.
+template <class Heap>
+class HeapResource : public std::pmr::memory_resource {
+public:
+    explicit HeapResource(Heap &heap) noexcept : heap_(heap) {}
+
+    Heap &heap() const noexcept { return heap_; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *ptr = align <= Heap::alignment ? heap_.allocate(bytes) : nullptr;
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        heap_.deallocate(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    Heap &heap_;
+};
+
+}  // namespace myalloc
+
+#endif
@@ -0,0 +1,127 @@
+// Free-path scaling: the old full-heap coalesce() scan vs boundary tags.
+//
+// For each heap size N we allocate N blocks, then free them all (every other
+// block first, so the second pass has two free neighbours to merge) and report
+// the average cost of one free. The legacy column is a copy of the original
+// singly-linked allocator, whose free rescans the whole heap; the
+// boundary-tag column is my_free.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "allocator.h"
+
+// Above TCACHE_MAX_SIZE (and so the slab sizes too), so each my_free goes
+// through the arena and merges with its neighbours
+#define PAYLOAD 1024
+
+// ========== Legacy Allocator (pre boundary tags) ==========
+
+typedef struct legacy_block {
+    size_t size;
+    int free;
+    struct legacy_block *next;
+} legacy_block_t;
+
+static legacy_block_t *legacy_head = NULL;
+static legacy_block_t *legacy_tail = NULL;
+static char *legacy_pool = NULL;
+static size_t legacy_used = 0;
+
+static void *legacy_malloc(size_t size) {
+    legacy_block_t *current = legacy_head;
+    while (current && !(current->free && current->size >= size)) {
+        current = current->next;
+    }
+    if (current) {
+        current->free = 0;
+        return current + 1;
+    }
+
+    legacy_block_t *block = (legacy_block_t*)(legacy_pool + legacy_used);
+    legacy_used += sizeof(legacy_block_t) + size;
+    block->size = size;
+    block->free = 0;
+    block->next = NULL;
+    if (legacy_tail) {
+        legacy_tail->next = block;
+    } else {
+        legacy_head = block;
+    }
+    legacy_tail = block;
+    return block + 1;
+}
+
+static void legacy_free(void *ptr) {
+    ((legacy_block_t*)ptr - 1)->free = 1;
+
+    // The original coalesce(): a walk over every block on every free
+    legacy_block_t *current = legacy_head;
+    while (current && current->next) {
+        if (current->free && current->next->free) {
+            current->size += sizeof(legacy_block_t) + current->next->size;
+            if (current->next == legacy_tail) {
+                legacy_tail = current;
+            }
+            current->next = current->next->next;
+        } else {
+            current = current->next;
+        }
+    }
+}
+
+static void legacy_reset(void) {
+    legacy_head = legacy_tail = NULL;
+    legacy_used = 0;
+}
+
+// ========== Benchmark Driver ==========
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Allocate n blocks, free them all, return average ns per free
+static double run(void *(*alloc)(size_t), void (*release)(void *),
+                  void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ptrs[i] = alloc(PAYLOAD);
+    }
+
+    double start = now_ns();
+    for (size_t i = 0; i < n; i += 2) {
+        release(ptrs[i]);
+    }
+    for (size_t i = 1; i < n; i += 2) {
+        release(ptrs[i]);
+    }
+    return (now_ns() - start) / n;
+}
+
+int main(int argc, char **argv) {
+    size_t max_blocks = argc > 1 ? strtoul(argv[1], NULL, 10) : 32768;
+
+    void **ptrs = malloc(max_blocks * sizeof(void*));
+    legacy_pool = malloc(max_blocks * (sizeof(legacy_block_t) + PAYLOAD));
+    if (!ptrs || !legacy_pool) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    my_malloc_set_fastbin_limit(0);  // Merge on every free, never defer it
+    printf("%10s %18s %18s\n", "blocks", "legacy ns/free", "tagged ns/free");
+    for (size_t n = 1024; n <= max_blocks; n *= 2) {
+        legacy_reset();
+        double legacy = run(legacy_malloc, legacy_free, ptrs, n);
+        double tagged = run(my_malloc, my_free, ptrs, n);
+        printf("%10zu %18.1f %18.1f\n", n, legacy, tagged);
+    }
+
+    free(legacy_pool);
+    free(ptrs);
+    return 0;
+}
@@ -0,0 +1,159 @@
+// Heaps built from the C++ front end (allocator.hpp) against my_malloc and
+// the system malloc.
+//
+// Each workload is run single-threaded on every allocator that can serve it
+// and reports wall time per operation:
+//   churn   a window of live objects of 16 to 512 bytes, each replaced by a
+//           new random-sized one in random order
+//   fixed   the same with every object 64 bytes, which a FixedPool serves
+//   map     a std::map<int, int> filled and emptied through its allocator
+//   list    a std::pmr::list<int> filled and emptied through a memory resource
+//
+// Usage: bench_policies [-s scale]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <vector>
+#include <unistd.h>
+
+#include "allocator.hpp"
+
+using namespace myalloc;
+
+static unsigned long scale = 1;
+
+static std::uint64_t rng_next(std::uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+template <class F>
+static void report(const char *workload, const char *name, unsigned long ops, F &&run) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("%-7s %-34s %8.1f ns/op\n", workload, name, elapsed.count() / ops);
+}
+
+// ========== Heap Workloads ==========
+
+#define WINDOW 4096
+
+// Replace objects in a window of live ones; size 0 picks random sizes
+template <class Alloc, class Free>
+static void churn(unsigned long ops, std::size_t size, Alloc &&alloc, Free &&release) {
+    std::vector<void*> live(WINDOW, nullptr);
+    std::uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    for (unsigned long i = 0; i < ops; i++) {
+        std::size_t slot = rng_next(rng) % WINDOW;
+        release(live[slot]);
+        live[slot] = alloc(size ? size : 16 + rng_next(rng) % 497);
+        static_cast<char*>(live[slot])[0] = 1;
+    }
+    for (void *ptr : live) {
+        release(ptr);
+    }
+}
+
+template <class Heap>
+static void churn_heap(const char *workload, const char *name, unsigned long ops, std::size_t size) {
+    report(workload, name, ops, [&] {
+        Heap heap;
+        churn(ops, size, [&](std::size_t n) { return heap.allocate(n); },
+              [&](void *ptr) { heap.deallocate(ptr); });
+    });
+}
+
+static void churn_c(const char *workload, unsigned long ops, std::size_t size) {
+    report(workload, "my_malloc", ops, [&] {
+        churn(ops, size, my_malloc, my_free);
+    });
+    report(workload, "system malloc", ops, [&] {
+        churn(ops, size, std::malloc, std::free);
+    });
+}
+
+// ========== Container Workloads ==========
+
+template <class Alloc>
+static void fill_map(unsigned long ops, const Alloc &alloc) {
+    std::map<int, int, std::less<int>, Alloc> map(alloc);
+    std::uint64_t rng = 1;
+    for (unsigned long i = 0; i < ops / 2; i++) {
+        map[(int)(rng_next(rng) % (ops / 2))] = (int)i;
+    }
+    while (!map.empty()) {
+        map.erase(map.begin());
+    }
+}
+
+static void fill_list(unsigned long ops, std::pmr::memory_resource *resource) {
+    std::pmr::list<int> list(resource);
+    for (unsigned long i = 0; i < ops / 2; i++) {
+        list.push_back((int)i);
+    }
+    while (!list.empty()) {
+        list.pop_front();
+    }
+}
+
+// Room for a std::map<int, int> node (40 bytes with libstdc++ and libc++)
+using MapPool = FixedPool<48>;
+using MapNode = std::pair<const int, int>;
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's' && std::strtoul(optarg, nullptr, 10) > 0) {
+            scale = std::strtoul(optarg, nullptr, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [-s scale]\n", argv[0]);
+            return 1;
+        }
+    }
+    unsigned long ops = 2000000 * scale;
+
+    churn_heap<LocalHeap>("churn", "LocalHeap (best fit, no lock)", ops, 0);
+    churn_heap<Allocator<FirstFit, Log2Classes, 16, NoLock>>("churn", "first fit, log2 classes, no lock", ops, 0);
+    churn_heap<Allocator<BestFit, ExactClasses<>, 16, MutexLock>>("churn", "best fit, mutex", ops, 0);
+    churn_c("churn", ops, 0);
+
+    churn_heap<FixedPool<64>>("fixed", "FixedPool<64>", ops, 64);
+    churn_heap<LocalHeap>("fixed", "LocalHeap (best fit, no lock)", ops, 64);
+    churn_c("fixed", ops, 64);
+
+    report("map", "std::allocator", ops, [&] {
+        fill_map(ops, std::allocator<MapNode>());
+    });
+    report("map", "MallocAllocator", ops, [&] {
+        fill_map(ops, MallocAllocator<MapNode>());
+    });
+    report("map", "HeapAllocator<LocalHeap>", ops, [&] {
+        LocalHeap heap;
+        fill_map(ops, HeapAllocator<MapNode, LocalHeap>(heap));
+    });
+    report("map", "HeapAllocator<FixedPool<48>>", ops, [&] {
+        MapPool pool;
+        fill_map(ops, HeapAllocator<MapNode, MapPool>(pool));
+    });
+
+    report("list", "new_delete_resource", ops, [&] {
+        fill_list(ops, std::pmr::new_delete_resource());
+    });
+    report("list", "malloc_resource", ops, [&] {
+        fill_list(ops, malloc_resource());
+    });
+    report("list", "HeapResource<LocalHeap>", ops, [&] {
+        LocalHeap heap;
+        HeapResource<LocalHeap> resource(heap);
+        fill_list(ops, &resource);
+    });
+    return 0;
+}
@@ -0,0 +1,510 @@
+// Allocator scalability: my_malloc against the system malloc at 1 to N
+// threads.
+//
+// Each workload runs at 1, 2, 4, ... threads up to N (and N itself), every
+// thread doing the same number of calls, once per allocator and each run in
+// a forked child as in bench_workloads. For each run we report:
+//   Mops/s    calls per second over all threads
+//   speedup   throughput over the same allocator's one-thread throughput
+//   p99/p999  latency of single malloc and free calls, in ns, from one
+//             call in LAT_SAMPLE timed on its own
+//   cont%     share of arena lock acquisitions that had to wait (my_malloc
+//             only, from malloc_stats_t; see Lock Profiling in allocator.c)
+//   wait      mean ns spent waiting per contended acquisition
+//   hold      mean ns an arena lock was held
+//   remote    remote frees per 1000 calls
+//
+// Workloads:
+//   local   each thread churns its own objects of 16 B - 1 KiB (thread caches
+//           and slabs)
+//   mid     the same with 1 - 32 KiB objects, which go to the arena bins
+//   remote  each thread hands every object it allocates to the next thread,
+//           which frees it (remote frees, when the two threads are on
+//           different arenas: there is one arena per CPU)
+//
+// -c and -j also write every row to a CSV or JSON file, for tracking runs
+// over time.
+//
+// Usage: bench_scaling [-t max-threads] [-s scale] [-c file.csv] [-j file.json] [workload ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#include "allocator.h"
+
+// ========== Allocators ==========
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    int mine;  // my_malloc: report its lock and remote-free counters
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    { "my_malloc",     my_malloc, my_free, 1 },
+    { "system malloc", malloc,    free,    0 },
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ========== Latency Histograms ==========
+// Log-linear buckets: values below 2^LAT_SUB_SHIFT get one bucket each,
+// every power of two above that LAT_SUBS buckets, so any percentile is
+// within 1/8 of the true value.
+#define LAT_SAMPLE    16   // Time one call in this many (a power of two)
+#define LAT_SUB_SHIFT 3
+#define LAT_SUBS      (1 << LAT_SUB_SHIFT)
+#define LAT_MAX_SHIFT 40   // Latencies are capped at 2^40 ns
+#define LAT_BUCKETS   ((LAT_MAX_SHIFT - LAT_SUB_SHIFT + 1) * LAT_SUBS)
+
+typedef struct {
+    uint64_t count[LAT_BUCKETS];
+    uint64_t total;
+} histogram_t;
+
+static size_t lat_bucket(uint64_t ns) {
+    if (ns < LAT_SUBS) {
+        return ns;
+    }
+    if (ns >= (uint64_t)1 << LAT_MAX_SHIFT) {
+        return LAT_BUCKETS - 1;
+    }
+    int k = 63 - __builtin_clzll(ns);
+    return ((size_t)(k - LAT_SUB_SHIFT + 1) << LAT_SUB_SHIFT) + ((ns >> (k - LAT_SUB_SHIFT)) & (LAT_SUBS - 1));
+}
+
+// Largest value that falls in a bucket
+static uint64_t lat_bucket_max(size_t bucket) {
+    if (bucket < LAT_SUBS) {
+        return bucket;
+    }
+    int k = (int)(bucket >> LAT_SUB_SHIFT) + LAT_SUB_SHIFT - 1;
+    uint64_t sub = bucket & (LAT_SUBS - 1);
+    return ((uint64_t)1 << k) + ((sub + 1) << (k - LAT_SUB_SHIFT)) - 1;
+}
+
+static void lat_record(histogram_t *h, uint64_t ns) {
+    h->count[lat_bucket(ns)]++;
+    h->total++;
+}
+
+static void lat_merge(histogram_t *into, const histogram_t *h) {
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        into->count[i] += h->count[i];
+    }
+    into->total += h->total;
+}
+
+static uint64_t lat_percentile(const histogram_t *h, double p) {
+    uint64_t rank = (uint64_t)(p * h->total), seen = 0;
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen > rank) {
+            return lat_bucket_max(i);
+        }
+    }
+    return 0;
+}
+
+// ========== Workers ==========
+
+typedef struct worker {
+    const allocator_t *a;
+    uint64_t rng;
+    uint64_t calls;
+    histogram_t malloc_lat;
+    histogram_t free_lat;
+    struct worker *next;    // Remote workload: the thread this one hands its objects to
+    // Remote workload: objects handed to this thread (single producer, single consumer)
+    void **inbox;
+    _Atomic size_t inbox_head;   // Next slot the producer fills
+    _Atomic size_t inbox_tail;   // Next slot the consumer empties
+} worker_t;
+
+static size_t scale = 1;
+static size_t num_threads;
+static pthread_barrier_t start_barrier;
+static atomic_uint producers_left;
+
+// xorshift64
+static uint64_t next_rand(worker_t *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+// A power-of-two class picked uniformly between min and max, then a uniform
+// size within it
+static size_t random_size(worker_t *w, size_t min, size_t max) {
+    size_t lo = 63 - __builtin_clzll(min);
+    size_t hi = 63 - __builtin_clzll(max);
+    size_t base = (size_t)1 << (lo + next_rand(w) % (hi - lo + 1));
+    size_t size = base + next_rand(w) % base;
+    return size < min ? min : size > max ? max : size;
+}
+
+static void *timed_malloc(worker_t *w, size_t size) {
+    if (++w->calls % LAT_SAMPLE) {
+        return w->a->malloc(size);
+    }
+    uint64_t start = now_ns();
+    void *ptr = w->a->malloc(size);
+    lat_record(&w->malloc_lat, now_ns() - start);
+    return ptr;
+}
+
+static void timed_free(worker_t *w, void *ptr) {
+    if (++w->calls % LAT_SAMPLE) {
+        w->a->free(ptr);
+        return;
+    }
+    uint64_t start = now_ns();
+    w->a->free(ptr);
+    lat_record(&w->free_lat, now_ns() - start);
+}
+
+// ========== Workloads ==========
+
+#define WINDOW 1024
+#define INBOX  1024   // A power of two
+
+// Replace random objects in a per-thread window of live ones
+static void churn(worker_t *w, size_t calls, size_t min, size_t max) {
+    void *live[WINDOW] = { 0 };
+    for (size_t i = 0; i < calls / 2; i++) {
+        size_t slot = next_rand(w) % WINDOW;
+        if (live[slot]) {
+            timed_free(w, live[slot]);
+        }
+        size_t size = random_size(w, min, max);
+        live[slot] = timed_malloc(w, size);
+        ((char*)live[slot])[size - 1] = 1;
+    }
+    for (size_t i = 0; i < WINDOW; i++) {
+        if (live[i]) {
+            timed_free(w, live[i]);
+        }
+    }
+}
+
+static void wl_local(worker_t *w) {
+    churn(w, 2000000 * scale, 16, 1024);
+}
+
+static void wl_mid(worker_t *w) {
+    churn(w, 400000 * scale, 1024, 32 * 1024);
+}
+
+// Free everything handed to this thread so far; returns how many
+static size_t drain_inbox(worker_t *w) {
+    size_t tail = atomic_load_explicit(&w->inbox_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&w->inbox_head, memory_order_acquire);
+    for (size_t i = tail; i != head; i++) {
+        timed_free(w, w->inbox[i % INBOX]);
+    }
+    atomic_store_explicit(&w->inbox_tail, head, memory_order_release);
+    return head - tail;
+}
+
+static void wl_remote(worker_t *w) {
+    worker_t *to = w->next;
+    for (size_t i = 0; i < 1000000 * scale; i++) {
+        void *ptr = timed_malloc(w, random_size(w, 16, 512));
+        size_t head = atomic_load_explicit(&to->inbox_head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&to->inbox_tail, memory_order_acquire) == INBOX) {
+            // The next thread is behind; keep our own inbox moving meanwhile
+            if (!drain_inbox(w)) {
+                sched_yield();
+            }
+        }
+        to->inbox[head % INBOX] = ptr;
+        atomic_store_explicit(&to->inbox_head, head + 1, memory_order_release);
+        if (i % 64 == 0) {
+            drain_inbox(w);
+        }
+    }
+    atomic_fetch_sub(&producers_left, 1);
+    while (atomic_load(&producers_left) > 0) {
+        if (!drain_inbox(w)) {
+            sched_yield();
+        }
+    }
+    drain_inbox(w);
+}
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*run)(worker_t *w);
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "local",  "per-thread churn 16 B - 1 KiB",  wl_local  },
+    { "mid",    "per-thread churn 1 - 32 KiB",    wl_mid    },
+    { "remote", "objects freed by the next thread", wl_remote },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// ========== Measurement ==========
+
+typedef struct {
+    double ns;
+    uint64_t calls;
+    uint64_t malloc_p99, malloc_p999;
+    uint64_t free_p99, free_p999;
+    // my_malloc only (from malloc_stats_t)
+    uint64_t lock_acquired, lock_contended, lock_wait_ns, lock_hold_ns, remote_frees;
+} result_t;
+
+static const workload_t *current;
+
+static void *worker_main(void *arg) {
+    pthread_barrier_wait(&start_barrier);
+    current->run(arg);
+    return NULL;
+}
+
+static void run(const workload_t *wl, const allocator_t *a, size_t threads, result_t *r) {
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    malloc_stats_t before, after;
+
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].a = a;
+        workers[i].rng = (i + 1) * 0x9e3779b97f4a7c15ULL;
+        workers[i].next = &workers[(i + 1) % threads];
+        workers[i].inbox = calloc(INBOX, sizeof(void*));
+    }
+    current = wl;
+    atomic_store(&producers_left, (unsigned int)threads);
+    pthread_barrier_init(&start_barrier, NULL, (unsigned int)threads + 1);
+    for (size_t i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+    }
+
+    my_malloc_stats(&before);
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    r->ns = (double)(now_ns() - start);
+    my_malloc_stats(&after);
+
+    histogram_t malloc_lat, free_lat;
+    memset(&malloc_lat, 0, sizeof(malloc_lat));
+    memset(&free_lat, 0, sizeof(free_lat));
+    r->calls = 0;
+    for (size_t i = 0; i < threads; i++) {
+        r->calls += workers[i].calls;
+        lat_merge(&malloc_lat, &workers[i].malloc_lat);
+        lat_merge(&free_lat, &workers[i].free_lat);
+        free(workers[i].inbox);
+    }
+    r->malloc_p99 = lat_percentile(&malloc_lat, 0.99);
+    r->malloc_p999 = lat_percentile(&malloc_lat, 0.999);
+    r->free_p99 = lat_percentile(&free_lat, 0.99);
+    r->free_p999 = lat_percentile(&free_lat, 0.999);
+
+    r->lock_acquired = after.lock_acquired - before.lock_acquired;
+    r->lock_contended = after.lock_contended - before.lock_contended;
+    r->lock_wait_ns = after.lock_wait_ns - before.lock_wait_ns;
+    r->lock_hold_ns = after.lock_hold_ns - before.lock_hold_ns;
+    r->remote_frees = after.remote_frees - before.remote_frees;
+
+    pthread_barrier_destroy(&start_barrier);
+    free(workers);
+    free(tids);
+}
+
+// Run in a child process, so one run's heap doesn't carry over into the next
+static int measure(const workload_t *wl, const allocator_t *a, size_t threads, result_t *out) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        result_t r;
+        run(wl, a, threads, &r);
+        _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return got == sizeof(*out) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// ========== Output ==========
+
+static FILE *csv;
+static FILE *json;
+static int json_rows;
+
+static double ratio(uint64_t num, uint64_t den) {
+    return den ? (double)num / den : 0.0;
+}
+
+static void report(const workload_t *wl, const allocator_t *a, size_t threads,
+                   const result_t *r, double base_mops) {
+    double mops = r->calls / r->ns * 1e3;
+    double speedup = base_mops > 0 ? mops / base_mops : 1.0;
+    double contended = 100.0 * ratio(r->lock_contended, r->lock_acquired);
+    double wait = ratio(r->lock_wait_ns, r->lock_contended);
+    double hold = ratio(r->lock_hold_ns, r->lock_acquired);
+    double remote = 1000.0 * ratio(r->remote_frees, r->calls);
+
+    printf("%-7s %7zu %-14s %8.2f %7.2f %8llu %8llu %8llu %8llu",
+           wl->name, threads, a->name, mops, speedup,
+           (unsigned long long)r->malloc_p99, (unsigned long long)r->malloc_p999,
+           (unsigned long long)r->free_p99, (unsigned long long)r->free_p999);
+    if (a->mine) {
+        printf(" %6.2f %7.0f %6.0f %7.1f\n", contended, wait, hold, remote);
+    } else {
+        printf(" %6s %7s %6s %7s\n", "-", "-", "-", "-");
+    }
+    fflush(stdout);
+
+    if (csv) {
+        fprintf(csv, "%s,%zu,%s,%.3f,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                wl->name, threads, a->name, mops, speedup,
+                (unsigned long long)r->malloc_p99, (unsigned long long)r->malloc_p999,
+                (unsigned long long)r->free_p99, (unsigned long long)r->free_p999,
+                (unsigned long long)r->calls, (unsigned long long)r->lock_acquired,
+                (unsigned long long)r->lock_contended, (unsigned long long)r->lock_wait_ns,
+                (unsigned long long)r->lock_hold_ns, (unsigned long long)r->remote_frees);
+    }
+    if (json) {
+        fprintf(json, "%s\n  {\"workload\": \"%s\", \"threads\": %zu, \"allocator\": \"%s\", "
+                      "\"mops\": %.3f, \"speedup\": %.3f, "
+                      "\"malloc_p99_ns\": %llu, \"malloc_p999_ns\": %llu, "
+                      "\"free_p99_ns\": %llu, \"free_p999_ns\": %llu, \"calls\": %llu",
+                json_rows++ ? "," : "", wl->name, threads, a->name, mops, speedup,
+                (unsigned long long)r->malloc_p99, (unsigned long long)r->malloc_p999,
+                (unsigned long long)r->free_p99, (unsigned long long)r->free_p999,
+                (unsigned long long)r->calls);
+        if (a->mine) {
+            fprintf(json, ", \"lock_acquired\": %llu, \"lock_contended\": %llu, "
+                          "\"lock_wait_ns\": %llu, \"lock_hold_ns\": %llu, \"remote_frees\": %llu",
+                    (unsigned long long)r->lock_acquired, (unsigned long long)r->lock_contended,
+                    (unsigned long long)r->lock_wait_ns, (unsigned long long)r->lock_hold_ns,
+                    (unsigned long long)r->remote_frees);
+        }
+        fprintf(json, "}");
+    }
+}
+
+static FILE *open_output(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    return f;
+}
+
+static int selected(const workload_t *wl, int argc, char **argv) {
+    if (optind >= argc) {
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (strcmp(argv[i], wl->name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 1, 2, 4, ... and num_threads itself
+static size_t next_count(size_t threads) {
+    return threads < num_threads && threads * 2 > num_threads ? num_threads : threads * 2;
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cpus > 4 ? (size_t)cpus : 4;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:c:j:")) != -1) {
+        if (opt == 't' && atoi(optarg) > 0) {
+            num_threads = (size_t)atoi(optarg);
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            scale = (size_t)atoi(optarg);
+        } else if (opt == 'c') {
+            csv = open_output(optarg);
+        } else if (opt == 'j') {
+            json = open_output(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-t max-threads] [-s scale] [-c file.csv] [-j file.json] "
+                            "[workload ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (csv) {
+        fprintf(csv, "workload,threads,allocator,mops,speedup,malloc_p99_ns,malloc_p999_ns,"
+                     "free_p99_ns,free_p999_ns,calls,lock_acquired,lock_contended,"
+                     "lock_wait_ns,lock_hold_ns,remote_frees\n");
+    }
+    if (json) {
+        fprintf(json, "[");
+    }
+    printf("%-7s %7s %-14s %8s %7s %8s %8s %8s %8s %6s %7s %6s %7s\n",
+           "workload", "threads", "allocator", "Mops/s", "speedup", "m p99", "m p999",
+           "f p99", "f p999", "cont%", "wait", "hold", "remote");
+
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        const workload_t *wl = &workloads[i];
+        if (!selected(wl, argc, argv)) {
+            continue;
+        }
+        for (size_t j = 0; j < NUM_ALLOCATORS; j++) {
+            double base_mops = 0;
+            for (size_t threads = 1; threads <= num_threads; threads = next_count(threads)) {
+                result_t r;
+                if (measure(wl, &allocators[j], threads, &r) != 0) {
+                    printf("%-7s %7zu %-14s %8s\n", wl->name, threads, allocators[j].name, "failed");
+                    continue;
+                }
+                report(wl, &allocators[j], threads, &r, base_mops);
+                if (threads == 1) {
+                    base_mops = r.calls / r.ns * 1e3;
+                }
+            }
+        }
+    }
+
+    if (json) {
+        fprintf(json, "\n]\n");
+        fclose(json);
+    }
+    if (csv) {
+        fclose(csv);
+    }
+    return 0;
+}
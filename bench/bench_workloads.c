@@ -0,0 +1,570 @@
+// Allocator workloads: my_malloc against the system malloc.
+//
+// Every workload runs once per allocator, each run in a forked child so the
+// peak RSS of one run (and whatever the allocator keeps cached) can't leak
+// into the next. For each run we report:
+//   ns/op   wall time per allocator call (malloc, free or realloc)
+//   Mops/s  calls per second over all threads
+//   RSS     peak resident memory of the run, in MiB, minus the process's
+//           resident memory before it started
+//   frag    that peak RSS divided by the peak number of bytes the workload
+//           had requested and not yet freed (1.00 = no overhead at all)
+//
+// my_malloc runs once per fit strategy (see my_malloc_set_strategy), so the
+// "fit" workload in particular shows which one reuses holes best; -f keeps
+// only one of them (best, first or next).
+//
+// Usage: bench_workloads [-s scale] [-t threads] [-f strategy] [workload ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "allocator.h"
+
+// ========== Allocators ==========
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    int strategy;  // my_malloc's fit strategy, or -1
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    { "my_malloc (best fit)",  my_malloc, my_free, my_realloc, FIT_BEST  },
+    { "my_malloc (first fit)", my_malloc, my_free, my_realloc, FIT_FIRST },
+    { "my_malloc (next fit)",  my_malloc, my_free, my_realloc, FIT_NEXT  },
+    { "system malloc",         malloc,    free,    realloc,    -1        },
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static const char *strategy_names[] = { "best", "first", "next" };
+static int only_strategy = -1;  // -f: run my_malloc with this strategy only
+
+static int parse_strategy(const char *name) {
+    for (int i = 0; i < (int)(sizeof(strategy_names) / sizeof(strategy_names[0])); i++) {
+        if (strcmp(name, strategy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ========== Bookkeeping ==========
+// Each thread counts its calls and the bytes it has allocated minus those
+// it has freed, and folds them into the shared totals every FLUSH_OPS calls,
+// so the counters cost next to nothing next to the allocator calls.
+
+#define FLUSH_OPS 64
+
+static atomic_llong live_bytes;
+static atomic_llong peak_live;
+static atomic_ullong total_ops;
+
+typedef struct {
+    unsigned long long ops;
+    long long delta;
+    uint64_t rng;
+} counter_t;
+
+static void flush(counter_t *c) {
+    long long live = atomic_fetch_add(&live_bytes, c->delta) + c->delta;
+    long long peak = atomic_load(&peak_live);
+    while (live > peak && !atomic_compare_exchange_weak(&peak_live, &peak, live)) {
+    }
+    atomic_fetch_add(&total_ops, c->ops);
+    c->ops = 0;
+    c->delta = 0;
+}
+
+static void count(counter_t *c, long long delta) {
+    c->delta += delta;
+    if (++c->ops % FLUSH_OPS == 0) {
+        flush(c);
+    }
+}
+
+static void counter_init(counter_t *c, uint64_t seed) {
+    c->ops = 0;
+    c->delta = 0;
+    c->rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+
+// xorshift64
+static uint64_t next_rand(counter_t *c) {
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 7;
+    c->rng ^= c->rng << 17;
+    return c->rng;
+}
+
+// Sizes skewed toward small objects: a power-of-two class picked uniformly
+// between min and max, then a uniform size within it
+static size_t random_size(counter_t *c, size_t min, size_t max) {
+    size_t lo = 63 - __builtin_clzll(min);
+    size_t hi = 63 - __builtin_clzll(max);
+    size_t base = (size_t)1 << (lo + next_rand(c) % (hi - lo + 1));
+    size_t size = base + next_rand(c) % base;
+    return size < min ? min : size > max ? max : size;
+}
+
+// Write to every page of a new object, as a real program would
+static void touch(void *ptr, size_t size) {
+    char *p = ptr;
+    for (size_t i = 0; i < size; i += 4096) {
+        p[i] = 1;
+    }
+    p[size - 1] = 1;
+}
+
+static size_t scale = 1;
+static size_t num_threads = 4;
+
+// ========== Workloads ==========
+
+// A FIFO window of 64-byte objects: every call frees the oldest one and
+// allocates its replacement
+static void wl_churn(const allocator_t *a) {
+    enum { WINDOW = 1024, SIZE = 64 };
+    void *slots[WINDOW];
+    counter_t c;
+    counter_init(&c, 1);
+
+    for (size_t i = 0; i < WINDOW; i++) {
+        slots[i] = a->malloc(SIZE);
+        touch(slots[i], SIZE);
+        count(&c, SIZE);
+    }
+    for (size_t i = 0; i < 4000000 * scale; i++) {
+        size_t idx = i % WINDOW;
+        a->free(slots[idx]);
+        count(&c, -SIZE);
+        slots[idx] = a->malloc(SIZE);
+        touch(slots[idx], SIZE);
+        count(&c, SIZE);
+    }
+    for (size_t i = 0; i < WINDOW; i++) {
+        a->free(slots[i]);
+        count(&c, -SIZE);
+    }
+    flush(&c);
+}
+
+// Random slots of a large table replaced by objects of random size
+static void wl_random(const allocator_t *a) {
+    enum { SLOTS = 16384 };
+    static void *slots[SLOTS];
+    static size_t sizes[SLOTS];
+    counter_t c;
+    counter_init(&c, 2);
+
+    for (size_t i = 0; i < 3000000 * scale; i++) {
+        size_t idx = next_rand(&c) % SLOTS;
+        if (slots[idx]) {
+            a->free(slots[idx]);
+            count(&c, -(long long)sizes[idx]);
+        }
+        sizes[idx] = random_size(&c, 8, 16384);
+        slots[idx] = a->malloc(sizes[idx]);
+        touch(slots[idx], sizes[idx]);
+        count(&c, sizes[idx]);
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (slots[i]) {
+            a->free(slots[i]);
+            count(&c, -(long long)sizes[i]);
+            slots[i] = NULL;
+        }
+    }
+    flush(&c);
+}
+
+// Producer/consumer: half the threads allocate objects and pass them
+// through a ring to a partner thread that frees them, so every free is a
+// cross-thread free
+#define RING_SIZE 1024
+
+typedef struct {
+    const allocator_t *a;
+    void *_Atomic ring[RING_SIZE];
+    size_t count;
+    uint64_t seed;
+} pipe_t;
+
+static void *producer(void *arg) {
+    pipe_t *p = arg;
+    counter_t c;
+    counter_init(&c, p->seed);
+
+    for (size_t i = 0; i < p->count; i++) {
+        size_t size = random_size(&c, 16, 1024);
+        size_t *obj = p->a->malloc(size);
+        touch(obj, size);
+        obj[0] = size;
+        count(&c, size);
+
+        void *_Atomic *slot = &p->ring[i % RING_SIZE];
+        while (atomic_load_explicit(slot, memory_order_acquire)) {
+            sched_yield();
+        }
+        atomic_store_explicit(slot, obj, memory_order_release);
+    }
+    flush(&c);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    pipe_t *p = arg;
+    counter_t c;
+    counter_init(&c, p->seed + 1);
+
+    for (size_t i = 0; i < p->count; i++) {
+        void *_Atomic *slot = &p->ring[i % RING_SIZE];
+        size_t *obj;
+        while (!(obj = atomic_load_explicit(slot, memory_order_acquire))) {
+            sched_yield();
+        }
+        atomic_store_explicit(slot, NULL, memory_order_relaxed);
+        count(&c, -(long long)obj[0]);
+        p->a->free(obj);
+    }
+    flush(&c);
+    return NULL;
+}
+
+static void wl_prodcons(const allocator_t *a) {
+    size_t pairs = num_threads / 2 ? num_threads / 2 : 1;
+    pipe_t *pipes = calloc(pairs, sizeof(pipe_t));
+    pthread_t *threads = malloc(2 * pairs * sizeof(pthread_t));
+
+    for (size_t i = 0; i < pairs; i++) {
+        pipes[i].a = a;
+        pipes[i].count = 2000000 * scale / pairs;
+        pipes[i].seed = 10 + 2 * i;
+        pthread_create(&threads[2 * i], NULL, producer, &pipes[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, &pipes[i]);
+    }
+    for (size_t i = 0; i < 2 * pairs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(pipes);
+}
+
+// Larson-style server: every thread replaces random objects in its own
+// table, and after each round the tables move to a fresh set of threads, so
+// objects routinely outlive the thread that allocated them
+#define LARSON_SLOTS  4096
+#define LARSON_ROUNDS 10
+
+typedef struct {
+    const allocator_t *a;
+    void *slots[LARSON_SLOTS];
+    size_t sizes[LARSON_SLOTS];
+    size_t count;
+    uint64_t seed;
+} larson_t;
+
+static void *larson_thread(void *arg) {
+    larson_t *t = arg;
+    counter_t c;
+    counter_init(&c, t->seed++);
+
+    for (size_t i = 0; i < t->count; i++) {
+        size_t idx = next_rand(&c) % LARSON_SLOTS;
+        if (t->slots[idx]) {
+            t->a->free(t->slots[idx]);
+            count(&c, -(long long)t->sizes[idx]);
+        }
+        t->sizes[idx] = 16 + next_rand(&c) % 497;
+        t->slots[idx] = t->a->malloc(t->sizes[idx]);
+        touch(t->slots[idx], t->sizes[idx]);
+        count(&c, t->sizes[idx]);
+    }
+    flush(&c);
+    return NULL;
+}
+
+static void wl_larson(const allocator_t *a) {
+    larson_t *tables = calloc(num_threads, sizeof(larson_t));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+
+    for (size_t i = 0; i < num_threads; i++) {
+        tables[i].a = a;
+        tables[i].count = 3000000 * scale / num_threads / LARSON_ROUNDS;
+        tables[i].seed = 100 + i * LARSON_ROUNDS;
+    }
+    for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+        // Thread i of this round takes over the table of thread i-1 of the last
+        for (size_t i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, larson_thread, &tables[(i + round) % num_threads]);
+        }
+        for (size_t i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    counter_t c;
+    counter_init(&c, 0);
+    for (size_t i = 0; i < num_threads; i++) {
+        for (size_t j = 0; j < LARSON_SLOTS; j++) {
+            if (tables[i].slots[j]) {
+                a->free(tables[i].slots[j]);
+                count(&c, -(long long)tables[i].sizes[j]);
+            }
+        }
+    }
+    flush(&c);
+    free(threads);
+    free(tables);
+}
+
+// Buffers growing by small appends through realloc, the way strings and
+// vectors grow, interleaved so that each one's neighbours keep changing
+static void wl_realloc(const allocator_t *a) {
+    enum { BUFFERS = 32, MAX_SIZE = 512 * 1024 };
+    void *bufs[BUFFERS];
+    size_t sizes[BUFFERS];
+    counter_t c;
+    counter_init(&c, 3);
+
+    for (size_t round = 0; round < 8 * scale; round++) {
+        memset(bufs, 0, sizeof(bufs));
+        memset(sizes, 0, sizeof(sizes));
+        for (int grown = 1; grown; ) {
+            grown = 0;
+            for (size_t i = 0; i < BUFFERS; i++) {
+                if (sizes[i] >= MAX_SIZE) {
+                    continue;
+                }
+                size_t size = sizes[i] + 1 + next_rand(&c) % 512;
+                bufs[i] = a->realloc(bufs[i], size);
+                ((char*)bufs[i])[size - 1] = 1;
+                count(&c, (long long)size - (long long)sizes[i]);
+                sizes[i] = size;
+                grown = 1;
+            }
+        }
+        for (size_t i = 0; i < BUFFERS; i++) {
+            a->free(bufs[i]);
+            count(&c, -(long long)sizes[i]);
+        }
+    }
+    flush(&c);
+}
+
+// Mid-sized blocks (past the thread cache and slabs, below the mmap
+// threshold) with a share of long-lived survivors pinned between them, so
+// that every allocation goes to the bins and the fit policy decides how
+// well the holes get reused
+static void wl_fit(const allocator_t *a) {
+    enum { SLOTS = 8192 };
+    static void *slots[SLOTS];
+    static size_t sizes[SLOTS];
+    counter_t c;
+    counter_init(&c, 4);
+
+    for (size_t i = 0; i < 2000000 * scale; i++) {
+        size_t idx = next_rand(&c) % SLOTS;
+        if (idx % 8 == 0 && slots[idx]) {
+            continue;  // Survivor
+        }
+        if (slots[idx]) {
+            a->free(slots[idx]);
+            count(&c, -(long long)sizes[idx]);
+        }
+        sizes[idx] = 600 + next_rand(&c) % (32 * 1024);
+        slots[idx] = a->malloc(sizes[idx]);
+        touch(slots[idx], sizes[idx]);
+        count(&c, sizes[idx]);
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (slots[i]) {
+            a->free(slots[i]);
+            count(&c, -(long long)sizes[i]);
+            slots[i] = NULL;
+        }
+    }
+    flush(&c);
+}
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*run)(const allocator_t *a);
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "churn",    "same-size churn (64 B FIFO)",       wl_churn    },
+    { "random",   "random sizes 8 B - 16 KiB",         wl_random   },
+    { "prodcons", "producer/consumer, remote frees",   wl_prodcons },
+    { "larson",   "larson-style server threads",       wl_larson   },
+    { "realloc",  "realloc growth to 512 KiB",         wl_realloc  },
+    { "fit",      "mid-size holes (fit strategy path)", wl_fit     },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// ========== Benchmark Driver ==========
+
+typedef struct {
+    double ns;
+    unsigned long long ops;
+    long long peak_live;
+    long rss_kib;
+} result_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Current resident set in KiB
+static long current_rss(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Run one workload in a child process and collect its numbers
+static int measure(const workload_t *w, const allocator_t *a, result_t *out) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (a->strategy >= 0) {
+            my_malloc_set_strategy(a->strategy);
+        }
+        long base = current_rss();
+        double start = now_ns();
+        w->run(a);
+
+        result_t r;
+        r.ns = now_ns() - start;
+        r.ops = atomic_load(&total_ops);
+        r.peak_live = atomic_load(&peak_live);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        r.rss_kib = usage.ru_maxrss - base;
+        _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return got == sizeof(*out) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int selected(const workload_t *w, int argc, char **argv, int first) {
+    if (first >= argc) {
+        return 1;
+    }
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], w->name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const workload_t *find_workload(const char *name) {
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        if (strcmp(name, workloads[i].name) == 0) {
+            return &workloads[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    while (first + 1 < argc && argv[first][0] == '-') {
+        if (strcmp(argv[first], "-s") == 0) {
+            scale = strtoul(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "-t") == 0) {
+            num_threads = strtoul(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "-f") == 0) {
+            only_strategy = parse_strategy(argv[first + 1]);
+            if (only_strategy < 0) {
+                fprintf(stderr, "unknown strategy %s (best, first or next)\n", argv[first + 1]);
+                return 1;
+            }
+        } else {
+            break;
+        }
+        first += 2;
+    }
+    if (scale < 1) {
+        scale = 1;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    for (int i = first; i < argc; i++) {
+        if (!find_workload(argv[i])) {
+            fprintf(stderr, "unknown workload %s (", argv[i]);
+            for (size_t j = 0; j < NUM_WORKLOADS; j++) {
+                fprintf(stderr, "%s%s", j ? ", " : "", workloads[j].name);
+            }
+            fprintf(stderr, ")\nusage: %s [-s scale] [-t threads] [-f strategy] [workload ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-36s %-22s %9s %9s %9s %7s\n",
+           "workload", "allocator", "ns/op", "Mops/s", "RSS MiB", "frag");
+    fflush(stdout);
+
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        const workload_t *w = &workloads[i];
+        if (!selected(w, argc, argv, first)) {
+            continue;
+        }
+        const char *description = w->description;
+        for (size_t j = 0; j < NUM_ALLOCATORS; j++) {
+            const allocator_t *a = &allocators[j];
+            if (only_strategy >= 0 && a->strategy >= 0 && a->strategy != only_strategy) {
+                continue;
+            }
+            result_t r;
+            if (measure(w, a, &r) != 0) {
+                printf("%-36s %-22s %9s\n", description, a->name, "failed");
+                description = "";
+                continue;
+            }
+            double frag = r.peak_live > 0 ? r.rss_kib * 1024.0 / r.peak_live : 0;
+            printf("%-36s %-22s %9.1f %9.2f %9.1f %7.2f\n", description, a->name,
+                   r.ns / r.ops, r.ops / r.ns * 1e3, r.rss_kib / 1024.0, frag);
+            description = "";
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+// Render a heap snapshot written by my_malloc_snapshot_dump as a
+// fragmentation heatmap.
+//
+// Every arena chunk becomes one row of cells, each cell covering an equal
+// share of the chunk; its shade is the fraction of the cell's bytes that
+// are handed out (block payloads and headers, or a slab page's used slots
+// spread over the page). Next to each row are its used share, its free
+// bytes and, for block chunks, its fragmentation: 1 - largest free block /
+// all free block bytes, as in malloc_stats_t. A row that is mostly pale with
+// high fragmentation is memory the heap holds but can't hand out in one
+// piece. Direct mappings are only summed up at the end.
+//
+// The map goes to stdout as text; -o also writes it as an SVG image.
+//
+// Usage: heap_heatmap [-w columns] [-o file.svg] snapshot-file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocator.h"
+
+#define DEFAULT_COLUMNS 64
+#define SVG_CELL        10    // Pixels per cell
+#define SVG_LABEL       300   // Pixels left of the cells for the row label
+
+// ========== Snapshot ==========
+
+static heap_snapshot_header_t header;
+static heap_record_t *records;
+static size_t num_records;
+
+static int load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(heap_record_t) || !header.chunk_size || !header.slab_size) {
+        fprintf(stderr, "%s: not a heap snapshot\n", path);
+        fclose(f);
+        return -1;
+    }
+    records = malloc((header.count ? header.count : 1) * sizeof(heap_record_t));
+    if (!records) {
+        fprintf(stderr, "out of memory\n");
+        fclose(f);
+        return -1;
+    }
+    num_records = fread(records, sizeof(heap_record_t), header.count, f);
+    if (num_records != header.count) {
+        fprintf(stderr, "%s: truncated after %zu of %llu records\n",
+                path, num_records, (unsigned long long)header.count);
+    }
+    fclose(f);
+    return 0;
+}
+
+// Arena records first, by arena and address; direct mappings last
+static int record_cmp(const void *a, const void *b) {
+    const heap_record_t *x = a, *y = b;
+    if (x->arena != y->arena) {
+        return x->arena < y->arena ? -1 : 1;
+    }
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// ========== Rows ==========
+
+typedef struct {
+    uint64_t base;        // Chunk address
+    unsigned int arena;
+    int slabs;            // Slab chunk (otherwise blocks)
+    double *cells;        // Bytes handed out per cell
+    uint64_t used;
+    uint64_t free;        // Blocks: free blocks, headers included; slabs: unused pages and slots
+    uint64_t largest;     // Blocks: largest free block, header included
+} row_t;
+
+static row_t *rows;
+static size_t num_rows;
+static size_t columns = DEFAULT_COLUMNS;
+
+// Add `bytes` handed out, spread evenly over [start, end) of the chunk
+static void fill(row_t *row, uint64_t start, uint64_t end, double bytes) {
+    double cell_size = (double)header.chunk_size / columns;
+    if (end > header.chunk_size) {
+        end = header.chunk_size;
+    }
+    if (start >= end) {
+        return;
+    }
+    double density = bytes / (end - start);
+    for (size_t c = (size_t)(start / cell_size); c < columns && c * cell_size < end; c++) {
+        double lo = c * cell_size > start ? c * cell_size : start;
+        double hi = (c + 1) * cell_size < end ? (c + 1) * cell_size : end;
+        if (hi > lo) {
+            row->cells[c] += (hi - lo) * density;
+        }
+    }
+}
+
+static row_t *new_row(const heap_record_t *rec, uint64_t base) {
+    rows = realloc(rows, (num_rows + 1) * sizeof(row_t));
+    row_t *row = &rows[num_rows++];
+    memset(row, 0, sizeof(*row));
+    row->base = base;
+    row->arena = rec->arena;
+    row->slabs = rec->kind == SNAPSHOT_SLAB;
+    row->cells = calloc(columns, sizeof(double));
+    if (row->slabs) {
+        row->free = header.chunk_size - header.slab_size;  // Less the pages in use, below
+    }
+    return row;
+}
+
+static void build_rows(void) {
+    row_t *row = NULL;
+    uint64_t last_addr = 0;
+
+    for (size_t i = 0; i < num_records; i++) {
+        const heap_record_t *rec = &records[i];
+        if (rec->kind == SNAPSHOT_DIRECT) {
+            continue;
+        }
+        if (row && rec->addr == last_addr) {
+            continue;  // A chunk the walk came across twice
+        }
+        uint64_t base = rec->addr & ~(uint64_t)(header.chunk_size - 1);
+        if (!row || row->base != base || row->arena != rec->arena) {
+            row = new_row(rec, base);
+        }
+        last_addr = rec->addr;
+
+        uint64_t offset = rec->addr - base;
+        if (rec->kind == SNAPSHOT_SLAB) {
+            uint64_t used = (uint64_t)rec->used * rec->size;
+            fill(row, offset, offset + header.slab_size, used);
+            row->used += used;
+            row->free -= used;
+        } else {
+            uint64_t span = header.header_size + (uint64_t)rec->size;
+            if (rec->used) {
+                fill(row, offset, offset + span, span);
+                row->used += span;
+            } else {
+                row->free += span;
+                if (span > row->largest) {
+                    row->largest = span;
+                }
+            }
+        }
+    }
+}
+
+// ========== Output ==========
+
+static double row_frag(const row_t *row) {
+    return row->free && !row->slabs ? 1.0 - (double)row->largest / row->free : 0.0;
+}
+
+static void print_text(void) {
+    static const char shades[] = " .:-=+*#%@";
+    double cell_size = (double)header.chunk_size / columns;
+
+    printf("%zu chunks of %u KiB, %zu columns of %.1f KiB; shade = share in use\n\n",
+           num_rows, header.chunk_size / 1024, columns, cell_size / 1024);
+    for (size_t r = 0; r < num_rows; r++) {
+        row_t *row = &rows[r];
+        printf("%2u %-6s %#14llx |", row->arena, row->slabs ? "slabs" : "blocks",
+               (unsigned long long)row->base);
+        for (size_t c = 0; c < columns; c++) {
+            double share = row->cells[c] / cell_size;
+            int shade = share <= 0 ? 0 : share >= 1 ? 9 : 1 + (int)(share * 8.999);
+            putchar(shades[shade]);
+        }
+        printf("| %5.1f%% used %9.1f KiB free", 100.0 * row->used / header.chunk_size,
+               row->free / 1024.0);
+        if (!row->slabs) {
+            printf("  frag %.2f", row_frag(row));
+        }
+        putchar('\n');
+    }
+
+    uint64_t used = 0, free_bytes = 0, largest = 0, block_free = 0;
+    for (size_t r = 0; r < num_rows; r++) {
+        used += rows[r].used;
+        free_bytes += rows[r].free;
+        if (!rows[r].slabs) {
+            block_free += rows[r].free;
+            if (rows[r].largest > largest) {
+                largest = rows[r].largest;
+            }
+        }
+    }
+    uint64_t direct = 0, direct_bytes = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        if (records[i].kind == SNAPSHOT_DIRECT) {
+            direct++;
+            direct_bytes += records[i].size;
+        }
+    }
+
+    printf("\nchunks: %.1f MiB used, %.1f MiB free, fragmentation %.2f\n",
+           used / 1048576.0, free_bytes / 1048576.0,
+           block_free ? 1.0 - (double)largest / block_free : 0.0);
+    printf("direct mappings: %llu, %.1f MiB\n", (unsigned long long)direct, direct_bytes / 1048576.0);
+}
+
+// Shade from pale (free) to dark blue (in use)
+static void svg_color(double share, char *out, size_t len) {
+    static const int free_rgb[3] = { 0xf7, 0xfb, 0xff };
+    static const int used_rgb[3] = { 0x08, 0x30, 0x6b };
+    int rgb[3];
+    share = share < 0 ? 0 : share > 1 ? 1 : share;
+    for (int i = 0; i < 3; i++) {
+        rgb[i] = (int)(free_rgb[i] + (used_rgb[i] - free_rgb[i]) * share + 0.5);
+    }
+    snprintf(out, len, "#%02x%02x%02x", rgb[0], rgb[1], rgb[2]);
+}
+
+static int write_svg(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    double cell_size = (double)header.chunk_size / columns;
+    size_t width = SVG_LABEL + columns * SVG_CELL;
+    size_t height = (num_rows + 1) * SVG_CELL;
+    fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%zu\" height=\"%zu\" "
+               "font-family=\"monospace\" font-size=\"%d\">\n", width, height, SVG_CELL - 1);
+
+    for (size_t r = 0; r < num_rows; r++) {
+        row_t *row = &rows[r];
+        size_t y = r * SVG_CELL;
+        fprintf(f, "<text x=\"0\" y=\"%zu\">%u %s %#llx %.1f%% frag %.2f</text>\n",
+                y + SVG_CELL - 1, row->arena, row->slabs ? "slabs " : "blocks",
+                (unsigned long long)row->base, 100.0 * row->used / header.chunk_size, row_frag(row));
+        for (size_t c = 0; c < columns; c++) {
+            char color[8];
+            svg_color(row->cells[c] / cell_size, color, sizeof(color));
+            fprintf(f, "<rect x=\"%zu\" y=\"%zu\" width=\"%d\" height=\"%d\" fill=\"%s\"/>\n",
+                    SVG_LABEL + c * SVG_CELL, y, SVG_CELL, SVG_CELL, color);
+        }
+    }
+    fprintf(f, "</svg>\n");
+
+    if (fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *svg = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:o:")) != -1) {
+        if (opt == 'w' && atoi(optarg) > 0) {
+            columns = (size_t)atoi(optarg);
+        } else if (opt == 'o') {
+            svg = optarg;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-w columns] [-o file.svg] snapshot-file\n", argv[0]);
+        return 1;
+    }
+
+    if (load(argv[optind]) != 0) {
+        return 1;
+    }
+    qsort(records, num_records, sizeof(heap_record_t), record_cmp);
+    build_rows();
+
+    print_text();
+    return svg && write_svg(svg) != 0 ? 1 : 0;
+}
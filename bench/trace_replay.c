@@ -0,0 +1,459 @@
+// Replay an allocation trace recorded with my_malloc_trace_start (or
+// MYALLOC_TRACE=file with the drop-in library) against my_malloc and the
+// system malloc.
+//
+// The trace is first compiled into one list of calls per recorded thread,
+// with every object given a slot of its own. Replay then runs one thread
+// per recorded thread, as fast as it can (the recorded timestamps are not
+// waited for). A thread that frees or reallocs an object another thread
+// allocated waits until that allocation has been replayed, so every free
+// still happens after its malloc. With -1, all calls run on one thread in
+// the order they were recorded. Objects allocated before the trace started
+// are left out: their frees are skipped and a realloc of one is replayed as
+// a malloc.
+//
+// Columns are as in bench_workloads (each run is in its own child process),
+// with my_malloc run once per fit strategy unless -f picks one (best, first
+// or next).
+//
+// Usage: trace_replay [-1] [-f strategy] trace-file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "allocator.h"
+
+// ========== Allocators ==========
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*memalign)(size_t alignment, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    int strategy;  // my_malloc's fit strategy, or -1
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    { "my_malloc (best fit)",  my_malloc, my_calloc, my_memalign, my_realloc, my_free, FIT_BEST  },
+    { "my_malloc (first fit)", my_malloc, my_calloc, my_memalign, my_realloc, my_free, FIT_FIRST },
+    { "my_malloc (next fit)",  my_malloc, my_calloc, my_memalign, my_realloc, my_free, FIT_NEXT  },
+    { "system malloc",         malloc,    calloc,    memalign,    realloc,    free,    -1        },
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static const char *strategy_names[] = { "best", "first", "next" };
+
+static int parse_strategy(const char *name) {
+    for (int i = 0; i < (int)(sizeof(strategy_names) / sizeof(strategy_names[0])); i++) {
+        if (strcmp(name, strategy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ========== Compiled Trace ==========
+
+#define NO_SLOT UINT32_MAX
+
+// One call to replay. `slot` is where the result goes (NO_SLOT for a free),
+// `old_slot` the object a free or realloc consumes (NO_SLOT for none).
+typedef struct {
+    uint32_t op;
+    uint32_t slot;
+    uint32_t old_slot;
+    uint32_t align;
+    uint64_t size;
+} call_t;
+
+typedef struct {
+    call_t *calls;
+    size_t count;
+    size_t capacity;
+} call_list_t;
+
+static call_list_t *lists;    // Per recorded thread (index = thread number)
+static size_t num_lists;
+static size_t num_slots;
+
+// Live objects during replay; a slot is filled once and emptied once
+static void *_Atomic *slots;
+static uint64_t *slot_sizes;
+
+static void append(size_t thread, call_t call) {
+    if (thread >= num_lists) {
+        size_t n = thread + 1;
+        lists = realloc(lists, n * sizeof(call_list_t));
+        memset(lists + num_lists, 0, (n - num_lists) * sizeof(call_list_t));
+        num_lists = n;
+    }
+    call_list_t *list = &lists[thread];
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 1024;
+        list->calls = realloc(list->calls, list->capacity * sizeof(call_t));
+    }
+    list->calls[list->count++] = call;
+}
+
+// Open-addressing map from a recorded address to the slot of the object
+// that lives there, for objects live at the current point of the trace
+typedef struct {
+    uint64_t id;
+    uint32_t slot;
+} map_entry_t;
+
+static map_entry_t *map;
+static size_t map_mask;
+static size_t map_used;
+
+static size_t map_hash(uint64_t id) {
+    return (size_t)((id >> 4) * 0x9e3779b97f4a7c15ULL) & map_mask;
+}
+
+static void map_grow(void);
+
+static void map_put(uint64_t id, uint32_t slot) {
+    if (2 * (map_used + 1) > map_mask + 1) {
+        map_grow();
+    }
+    size_t i = map_hash(id);
+    while (map[i].id && map[i].id != id) {
+        i = (i + 1) & map_mask;
+    }
+    if (!map[i].id) {
+        map_used++;
+    }
+    map[i].id = id;
+    map[i].slot = slot;
+}
+
+static void map_grow(void) {
+    map_entry_t *old = map;
+    size_t old_size = map ? map_mask + 1 : 0;
+
+    map_mask = old_size ? 2 * old_size - 1 : 4095;
+    map = calloc(map_mask + 1, sizeof(map_entry_t));
+    map_used = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].id) {
+            map_put(old[i].id, old[i].slot);
+        }
+    }
+    free(old);
+}
+
+// Remove an address and return its slot, or NO_SLOT if it isn't live
+static uint32_t map_take(uint64_t id) {
+    if (!map) {
+        return NO_SLOT;
+    }
+    size_t i = map_hash(id);
+    while (map[i].id) {
+        if (map[i].id == id) {
+            uint32_t slot = map[i].slot;
+            // Backward-shift deletion keeps the probe sequences intact
+            size_t hole = i;
+            for (size_t j = (i + 1) & map_mask; map[j].id; j = (j + 1) & map_mask) {
+                size_t home = map_hash(map[j].id);
+                if (((j - home) & map_mask) >= ((j - hole) & map_mask)) {
+                    map[hole] = map[j];
+                    hole = j;
+                }
+            }
+            map[hole].id = 0;
+            map_used--;
+            return slot;
+        }
+        i = (i + 1) & map_mask;
+    }
+    return NO_SLOT;
+}
+
+// Turn the records into per-thread call lists; returns the number of calls
+static size_t compile(FILE *f, int single_thread) {
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "not an allocation trace\n");
+        exit(1);
+    }
+
+    size_t total = 0;
+    trace_record_t r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        call_t call = { r.op, NO_SLOT, NO_SLOT, 0, r.size };
+
+        switch (r.op) {
+        case TRACE_FREE:
+            call.old_slot = map_take(r.id);
+            if (call.old_slot == NO_SLOT) {
+                continue;  // Allocated before the trace started
+            }
+            break;
+        case TRACE_REALLOC:
+            if (r.id == 0 && r.size != 0) {
+                continue;  // Failed: the old object stays where it was
+            }
+            call.old_slot = r.arg ? map_take(r.arg) : NO_SLOT;
+            if (r.size == 0) {
+                if (call.old_slot == NO_SLOT) {
+                    continue;
+                }
+                call.op = TRACE_FREE;
+                break;
+            }
+            if (call.old_slot == NO_SLOT) {
+                call.op = TRACE_MALLOC;
+            }
+            call.slot = num_slots++;
+            map_put(r.id, call.slot);
+            break;
+        case TRACE_MEMALIGN:
+            call.align = r.arg;
+            // Fall through
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+            if (r.id == 0) {
+                continue;  // Failed
+            }
+            call.slot = num_slots++;
+            map_put(r.id, call.slot);
+            break;
+        default:
+            fprintf(stderr, "bad record\n");
+            exit(1);
+        }
+
+        append(single_thread ? 0 : r.thread, call);
+        total++;
+    }
+    return total;
+}
+
+// ========== Replay ==========
+
+static atomic_llong live_bytes;
+static atomic_llong peak_live;
+
+typedef struct {
+    const allocator_t *a;
+    call_list_t *list;
+} replay_t;
+
+// Wait for another thread to have allocated the object, then take it
+static void *claim(uint32_t slot) {
+    void *ptr;
+    while (!(ptr = atomic_load_explicit(&slots[slot], memory_order_acquire))) {
+        sched_yield();
+    }
+    atomic_store_explicit(&slots[slot], NULL, memory_order_relaxed);
+    return ptr;
+}
+
+static void *replay_thread(void *arg) {
+    replay_t *r = arg;
+    const allocator_t *a = r->a;
+    long long delta = 0;
+
+    for (size_t i = 0; i < r->list->count; i++) {
+        call_t *c = &r->list->calls[i];
+        void *ptr = NULL;
+
+        switch (c->op) {
+        case TRACE_MALLOC:
+            ptr = a->malloc(c->size);
+            break;
+        case TRACE_CALLOC:
+            ptr = a->calloc(1, c->size);
+            break;
+        case TRACE_MEMALIGN:
+            ptr = a->memalign(c->align, c->size);
+            break;
+        case TRACE_REALLOC:
+            delta -= slot_sizes[c->old_slot];
+            ptr = a->realloc(claim(c->old_slot), c->size);
+            break;
+        case TRACE_FREE:
+            delta -= slot_sizes[c->old_slot];
+            a->free(claim(c->old_slot));
+            break;
+        }
+
+        if (c->slot != NO_SLOT) {
+            if (!ptr) {
+                fprintf(stderr, "allocation of %llu bytes failed\n", (unsigned long long)c->size);
+                exit(1);
+            }
+            *(char*)ptr = 1;
+            slot_sizes[c->slot] = c->size;
+            delta += c->size;
+            atomic_store_explicit(&slots[c->slot], ptr, memory_order_release);
+        }
+
+        if (i % 64 == 63 || i + 1 == r->list->count) {
+            long long live = atomic_fetch_add(&live_bytes, delta) + delta;
+            long long peak = atomic_load(&peak_live);
+            while (live > peak && !atomic_compare_exchange_weak(&peak_live, &peak, live)) {
+            }
+            delta = 0;
+        }
+    }
+    return NULL;
+}
+
+// Replay the whole trace; objects still live at its end are left alone
+static void replay(const allocator_t *a) {
+    replay_t *args = calloc(num_lists, sizeof(replay_t));
+    pthread_t *threads = calloc(num_lists, sizeof(pthread_t));
+
+    for (size_t i = 0; i < num_lists; i++) {
+        args[i].a = a;
+        args[i].list = &lists[i];
+        if (lists[i].count) {
+            pthread_create(&threads[i], NULL, replay_thread, &args[i]);
+        }
+    }
+    for (size_t i = 0; i < num_lists; i++) {
+        if (lists[i].count) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(threads);
+    free(args);
+}
+
+// ========== Benchmark Driver ==========
+
+typedef struct {
+    double ns;
+    long long peak_live;
+    long rss_kib;
+} result_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long current_rss(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int measure(const allocator_t *a, result_t *out) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (a->strategy >= 0) {
+            my_malloc_set_strategy(a->strategy);
+        }
+        long base = current_rss();
+        double start = now_ns();
+        replay(a);
+
+        result_t r;
+        r.ns = now_ns() - start;
+        r.peak_live = atomic_load(&peak_live);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        r.rss_kib = usage.ru_maxrss - base;
+        _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return got == sizeof(*out) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int single_thread = 0, only_strategy = -1, opt;
+    while ((opt = getopt(argc, argv, "1f:")) != -1) {
+        if (opt == '1') {
+            single_thread = 1;
+        } else if (opt == 'f' && (only_strategy = parse_strategy(optarg)) >= 0) {
+            continue;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-1] [-f best|first|next] trace-file\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t total = compile(f, single_thread);
+    fclose(f);
+    free(map);
+
+    size_t threads = 0;
+    for (size_t i = 0; i < num_lists; i++) {
+        threads += lists[i].count > 0;
+    }
+    printf("%zu calls on %zu thread%s, %zu objects\n",
+           total, threads, threads == 1 ? "" : "s", num_slots);
+
+    // Touched by the replay, so these come before the base RSS is taken
+    slots = calloc(num_slots ? num_slots : 1, sizeof(*slots));
+    slot_sizes = calloc(num_slots ? num_slots : 1, sizeof(*slot_sizes));
+    if (!slots || !slot_sizes) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(slot_sizes, 0, num_slots * sizeof(*slot_sizes));
+    memset((void*)slots, 0, num_slots * sizeof(*slots));
+
+    printf("%-22s %9s %9s %9s %7s\n", "allocator", "ns/op", "Mops/s", "RSS MiB", "frag");
+    for (size_t j = 0; j < NUM_ALLOCATORS; j++) {
+        if (only_strategy >= 0 && allocators[j].strategy >= 0 && allocators[j].strategy != only_strategy) {
+            continue;
+        }
+        result_t r;
+        if (measure(&allocators[j], &r) != 0 || total == 0) {
+            printf("%-22s %9s\n", allocators[j].name, "failed");
+            continue;
+        }
+        double frag = r.peak_live > 0 ? r.rss_kib * 1024.0 / r.peak_live : 0;
+        printf("%-22s %9.1f %9.2f %9.1f %7.2f\n", allocators[j].name,
+               r.ns / total, total / r.ns * 1e3, r.rss_kib / 1024.0, frag);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,372 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "allocator.h"
+
+// ========== Persistent Heaps ==========
+// A persistent heap is a file mapped MAP_SHARED, so everything allocated in
+// it is in the file and outlives the process. It uses the block layout of
+// the main heap: a header word holding the block's size and the FREE and
+// PREV_INUSE flags, links and a boundary tag inside free blocks, and
+// segregated free lists. Nothing in the file is an address, though: the
+// links are self-relative offsets and the bins, the root and the sizes are
+// offsets from the start of the file, so the heap works wherever a later
+// process happens to map it.
+//
+// The whole reservation (max_size) is mapped at once, past the end of the
+// file; growing the heap is an ftruncate that makes more of the mapping
+// usable, so the heap never moves while it is open.
+//
+// File layout: one page of header, then blocks. Each block spans its header
+// word plus its payload, in multiples of 16 bytes, and starts 8 bytes before
+// a 16-byte boundary so every payload is 16-byte aligned. The last word of
+// the file is a zero-sized, permanently used epilogue.
+#define PHEAP_MAGIC       "MYALPHP1"
+#define PHEAP_VERSION     1
+#define PHEAP_HEADER      4096                 // Header page at the start of the file
+#define PHEAP_GROW        (1024 * 1024)        // The file grows by at least this much
+#define PHEAP_DEFAULT_MAX ((size_t)1 << 30)    // Reservation when max_size is 0
+#define PHEAP_BINS        48                   // One free list per power of two of block span
+#define PHEAP_ALIGNMENT   16
+#define PHEAP_ALIGN(size) (((size) + (PHEAP_ALIGNMENT-1)) & ~(size_t)(PHEAP_ALIGNMENT-1))
+
+#define PBLOCK_FREE       1
+#define PBLOCK_PREV_INUSE 2
+#define PBLOCK_FLAGS      (PHEAP_ALIGNMENT - 1)
+#define PBLOCK_HEADER     sizeof(uint64_t)
+#define PBLOCK_MIN        32                   // Header, two links and the boundary tag
+
+typedef struct {
+    uint64_t header;      // Span (header word and payload) plus the flags
+    int64_t next_free;    // Self-relative links, only while the block is free
+    int64_t prev_free;
+} pblock_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t open;                // Set from pheap_open until pheap_close
+    uint64_t size;                // Bytes in the file
+    uint64_t root;                // File offset of the root object (0 = none)
+    uint64_t bins[PHEAP_BINS];    // File offset of each bin's first free block (0 = empty)
+} pheap_header_t;
+
+struct pheap {
+    pthread_mutex_t lock;
+    int fd;
+    char *base;                   // Where the file is mapped in this process
+    size_t reserved;              // Bytes of address space mapped for it
+    pheap_header_t *header;       // At base
+};
+
+// ========== Offsets ==========
+
+static int64_t rel(const void *from, const void *to) {
+    return to ? (char*)to - (char*)from : 0;
+}
+
+static void *unrel(const void *from, int64_t offset) {
+    return offset ? (char*)from + offset : NULL;
+}
+
+void pheap_ref_set(pheap_ref_t *ref, const void *target) {
+    ref->offset = rel(ref, target);
+}
+
+void *pheap_ref_get(const pheap_ref_t *ref) {
+    return unrel(ref, ref->offset);
+}
+
+// ========== Blocks ==========
+
+static size_t span(pblock_t *block) {
+    return block->header & ~(uint64_t)PBLOCK_FLAGS;
+}
+
+static pblock_t *next_pblock(pblock_t *block) {
+    return (pblock_t*)((char*)block + span(block));
+}
+
+// The block before, if it is free
+static pblock_t *prev_free_pblock(pblock_t *block) {
+    if (block->header & PBLOCK_PREV_INUSE) {
+        return NULL;
+    }
+    return (pblock_t*)((char*)block - *(uint64_t*)((char*)block - sizeof(uint64_t)));
+}
+
+static void set_free(pblock_t *block) {
+    block->header |= PBLOCK_FREE;
+    *(uint64_t*)((char*)block + span(block) - sizeof(uint64_t)) = span(block);
+    next_pblock(block)->header &= ~(uint64_t)PBLOCK_PREV_INUSE;
+}
+
+static void set_used(pblock_t *block) {
+    block->header &= ~(uint64_t)PBLOCK_FREE;
+    next_pblock(block)->header |= PBLOCK_PREV_INUSE;
+}
+
+static size_t pbin_index(size_t size) {
+    size_t idx = (63 - __builtin_clzll(size)) - 5;  // log2(PBLOCK_MIN) is 5
+    return idx < PHEAP_BINS ? idx : PHEAP_BINS - 1;
+}
+
+static pblock_t *bin_head(pheap_t *heap, size_t idx) {
+    uint64_t offset = heap->header->bins[idx];
+    return offset ? (pblock_t*)(heap->base + offset) : NULL;
+}
+
+static void insert_pblock(pheap_t *heap, pblock_t *block) {
+    size_t idx = pbin_index(span(block));
+    pblock_t *head = bin_head(heap, idx);
+    block->prev_free = 0;
+    block->next_free = rel(&block->next_free, head);
+    if (head) {
+        head->prev_free = rel(&head->prev_free, block);
+    }
+    heap->header->bins[idx] = (char*)block - heap->base;
+}
+
+static void remove_pblock(pheap_t *heap, pblock_t *block) {
+    pblock_t *next = unrel(&block->next_free, block->next_free);
+    pblock_t *prev = unrel(&block->prev_free, block->prev_free);
+    if (prev) {
+        prev->next_free = rel(&prev->next_free, next);
+    } else {
+        heap->header->bins[pbin_index(span(block))] = next ? (uint64_t)((char*)next - heap->base) : 0;
+    }
+    if (next) {
+        next->prev_free = rel(&next->prev_free, prev);
+    }
+}
+
+// Mark a block free, merge it with its free neighbours and bin it
+static void release_pblock(pheap_t *heap, pblock_t *block) {
+    pblock_t *next = next_pblock(block);
+    if (next->header & PBLOCK_FREE) {
+        remove_pblock(heap, next);
+        block->header += span(next);
+    }
+    pblock_t *prev = prev_free_pblock(block);
+    if (prev) {
+        remove_pblock(heap, prev);
+        prev->header += span(block);
+        block = prev;
+    }
+    set_free(block);
+    insert_pblock(heap, block);
+}
+
+// First fit in the request's own bin, else the first block of a higher one
+// (which always fits)
+static pblock_t *find_pblock(pheap_t *heap, size_t size) {
+    size_t idx = pbin_index(size);
+    for (pblock_t *block = bin_head(heap, idx); block; block = unrel(&block->next_free, block->next_free)) {
+        if (span(block) >= size) {
+            return block;
+        }
+    }
+    for (idx++; idx < PHEAP_BINS; idx++) {
+        pblock_t *block = bin_head(heap, idx);
+        if (block) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+// Extend the file by at least `size` bytes; the old epilogue becomes the
+// header of a free block over the new space
+static int grow(pheap_t *heap, size_t size) {
+    uint64_t old_size = heap->header->size;
+    size_t add = (size + PHEAP_GROW - 1) / PHEAP_GROW * PHEAP_GROW;
+    if (add > heap->reserved - old_size) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (ftruncate(heap->fd, old_size + add) != 0) {
+        return -1;
+    }
+    heap->header->size = old_size + add;
+
+    pblock_t *block = (pblock_t*)(heap->base + old_size - PBLOCK_HEADER);
+    block->header = add | (block->header & PBLOCK_PREV_INUSE);
+    next_pblock(block)->header = 0;  // New epilogue, used; set_free clears PREV_INUSE
+    release_pblock(heap, block);
+    return 0;
+}
+
+// ========== Opening and Closing ==========
+
+// Lay out an empty heap in a freshly truncated file
+static void format(pheap_t *heap, uint64_t size) {
+    pheap_header_t *header = heap->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, PHEAP_MAGIC, sizeof(header->magic));
+    header->version = PHEAP_VERSION;
+    header->size = size;
+
+    pblock_t *first = (pblock_t*)(heap->base + PHEAP_HEADER + PHEAP_ALIGNMENT - PBLOCK_HEADER);
+    first->header = (size - PHEAP_HEADER - PHEAP_ALIGNMENT) | PBLOCK_PREV_INUSE;
+    next_pblock(first)->header = PBLOCK_PREV_INUSE;  // Epilogue
+    set_free(first);
+    insert_pblock(heap, first);
+}
+
+pheap_t *pheap_open(const char *path, size_t max_size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    max_size = max_size ? (max_size + page - 1) & ~(page - 1) : PHEAP_DEFAULT_MAX;
+    if (max_size < PHEAP_HEADER + PHEAP_GROW) {
+        max_size = PHEAP_HEADER + PHEAP_GROW;
+    }
+
+    pheap_t *heap = my_malloc(sizeof(pheap_t));
+    if (!heap) {
+        return NULL;
+    }
+    heap->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (heap->fd < 0) {
+        goto fail_free;
+    }
+    // One process at a time: the free lists are only guarded by our lock
+    if (flock(heap->fd, LOCK_EX | LOCK_NB) != 0) {
+        goto fail_close;
+    }
+
+    struct stat st;
+    if (fstat(heap->fd, &st) != 0) {
+        goto fail_close;
+    }
+    int fresh = st.st_size == 0;
+    if (fresh) {
+        if (ftruncate(heap->fd, PHEAP_HEADER + PHEAP_GROW) != 0) {
+            goto fail_close;
+        }
+    } else if ((size_t)st.st_size < PHEAP_HEADER + PHEAP_GROW) {
+        errno = EINVAL;
+        goto fail_close;
+    } else if ((size_t)st.st_size > max_size) {
+        max_size = ((size_t)st.st_size + page - 1) & ~(page - 1);
+    }
+
+    heap->reserved = max_size;
+    heap->base = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, heap->fd, 0);
+    if (heap->base == MAP_FAILED) {
+        goto fail_close;
+    }
+    heap->header = (pheap_header_t*)heap->base;
+
+    if (fresh) {
+        format(heap, PHEAP_HEADER + PHEAP_GROW);
+    } else if (memcmp(heap->header->magic, PHEAP_MAGIC, sizeof(heap->header->magic)) != 0 ||
+               heap->header->version != PHEAP_VERSION || heap->header->size != (uint64_t)st.st_size) {
+        errno = EINVAL;
+        goto fail_unmap;
+    } else if (heap->header->open) {
+        // The last process to use it never closed it and may have died
+        // halfway through changing the free lists
+        errno = EUCLEAN;
+        goto fail_unmap;
+    }
+    heap->header->open = 1;
+
+    pthread_mutex_init(&heap->lock, NULL);
+    return heap;
+
+fail_unmap:
+    munmap(heap->base, heap->reserved);
+fail_close:
+    close(heap->fd);
+fail_free:
+    my_free(heap);
+    return NULL;
+}
+
+int pheap_sync(pheap_t *heap) {
+    pthread_mutex_lock(&heap->lock);
+    int err = msync(heap->base, heap->header->size, MS_SYNC);
+    pthread_mutex_unlock(&heap->lock);
+    return err;
+}
+
+int pheap_close(pheap_t *heap) {
+    if (!heap) {
+        return 0;
+    }
+    heap->header->open = 0;
+    int err = msync(heap->base, heap->header->size, MS_SYNC);
+    munmap(heap->base, heap->reserved);
+    close(heap->fd);
+    pthread_mutex_destroy(&heap->lock);
+    my_free(heap);
+    return err;
+}
+
+// ========== Allocation ==========
+
+void *pheap_alloc(pheap_t *heap, size_t size) {
+    if (size > heap->reserved) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = PHEAP_ALIGN(size + PBLOCK_HEADER);
+    if (size < PBLOCK_MIN) {
+        size = PBLOCK_MIN;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    pblock_t *block = find_pblock(heap, size);
+    if (!block && grow(heap, size) == 0) {
+        block = find_pblock(heap, size);
+    }
+    if (!block) {
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+    remove_pblock(heap, block);
+    set_used(block);
+
+    // Give the tail back to the bins
+    size_t rest = span(block) - size;
+    if (rest >= PBLOCK_MIN) {
+        block->header -= rest;
+        pblock_t *tail = next_pblock(block);
+        tail->header = rest | PBLOCK_PREV_INUSE;
+        release_pblock(heap, tail);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return (char*)block + PBLOCK_HEADER;
+}
+
+void pheap_free(pheap_t *heap, void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    pthread_mutex_lock(&heap->lock);
+    release_pblock(heap, (pblock_t*)((char*)ptr - PBLOCK_HEADER));
+    pthread_mutex_unlock(&heap->lock);
+}
+
+size_t pheap_usable_size(pheap_t *heap, void *ptr) {
+    (void)heap;
+    return ptr ? span((pblock_t*)((char*)ptr - PBLOCK_HEADER)) - PBLOCK_HEADER : 0;
+}
+
+// ========== Root Object ==========
+
+void *pheap_root(pheap_t *heap) {
+    uint64_t offset = heap->header->root;
+    return offset ? heap->base + offset : NULL;
+}
+
+void pheap_set_root(pheap_t *heap, void *ptr) {
+    heap->header->root = ptr ? (uint64_t)((char*)ptr - heap->base) : 0;
+}
@@ -0,0 +1,274 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+
+// ========== Drop-in Replacement ==========
+// Built into libmyalloc.so (see the Makefile), this file exports the libc
+// allocation functions on top of the my_* API, so any dynamically linked
+// program can run on this allocator:
+//   LD_PRELOAD=./libmyalloc.so ./program
+// Everything else in the library is compiled with hidden visibility, so only
+// these names interpose on libc's.
+#define EXPORT __attribute__((visibility("default")))
+
+// ========== Recursion Guard ==========
+// The allocator calls into libc (sysconf, pthread_once, pthread_setspecific,
+// pthread_atfork) on its first use in a process or thread, and some of
+// those calls allocate. While a thread is inside the allocator, nested
+// requests are served from a static bootstrap buffer instead of recursing.
+// Bootstrap memory is never reused; freeing it is a no-op.
+#define BOOTSTRAP_SIZE      (64 * 1024)
+#define BOOTSTRAP_ALIGNMENT 16
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGNMENT)));
+static size_t bootstrap_used;
+
+static __thread __attribute__((tls_model("initial-exec"))) int in_allocator;
+
+// Each bootstrap allocation is preceded by its size, padded to the alignment
+static void *bootstrap_alloc(size_t size) {
+    if (size > BOOTSTRAP_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t need = BOOTSTRAP_ALIGNMENT +
+                  ((size + BOOTSTRAP_ALIGNMENT - 1) & ~(size_t)(BOOTSTRAP_ALIGNMENT - 1));
+    size_t offset = __atomic_fetch_add(&bootstrap_used, need, __ATOMIC_RELAXED);
+
+    if (offset + need > BOOTSTRAP_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *(size_t*)(bootstrap + offset) = size;
+    return bootstrap + offset + BOOTSTRAP_ALIGNMENT;
+}
+
+static int is_bootstrap(void *ptr) {
+    return (char*)ptr >= bootstrap && (char*)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t bootstrap_size(void *ptr) {
+    return *(size_t*)((char*)ptr - BOOTSTRAP_ALIGNMENT);
+}
+
+// ========== Exported Functions ==========
+
+// malloc(0) must return a unique pointer, and failures must set errno
+EXPORT void *malloc(size_t size) {
+    if (in_allocator) {
+        return bootstrap_alloc(size);
+    }
+
+    in_allocator = 1;
+    void *ptr = my_malloc(size ? size : 1);
+    in_allocator = 0;
+
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void free(void *ptr) {
+    if (!ptr || is_bootstrap(ptr)) {
+        return;
+    }
+
+    in_allocator = 1;
+    my_free(ptr);
+    in_allocator = 0;
+}
+
+// Bootstrap memory is never reused, so it is zero already
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (in_allocator) {
+        return bootstrap_alloc(nmemb * size);
+    }
+
+    in_allocator = 1;
+    void *ptr = my_calloc(nmemb ? nmemb : 1, size ? size : 1);
+    in_allocator = 0;
+
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr && is_bootstrap(ptr)) {
+        // Move out of the bootstrap buffer into the real heap
+        void *new_ptr = malloc(size);
+        if (new_ptr) {
+            size_t old_size = bootstrap_size(ptr);
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        }
+        return new_ptr;
+    }
+    if (in_allocator) {
+        return ptr ? NULL : bootstrap_alloc(size);
+    }
+
+    in_allocator = 1;
+    void *new_ptr = my_realloc(ptr, ptr || size ? size : 1);
+    in_allocator = 0;
+
+    if (!new_ptr && size) {
+        errno = ENOMEM;
+    }
+    return new_ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    // On failure *memptr is left as it was
+    if (in_allocator) {
+        if (alignment < sizeof(void*) || (alignment & (alignment - 1))) {
+            return EINVAL;
+        }
+        void *ptr = alignment <= BOOTSTRAP_ALIGNMENT ? bootstrap_alloc(size) : NULL;
+        if (!ptr) {
+            return ENOMEM;
+        }
+        *memptr = ptr;
+        return 0;
+    }
+
+    in_allocator = 1;
+    int err = my_posix_memalign(memptr, alignment, size ? size : 1);
+    in_allocator = 0;
+    return err;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    void *ptr;
+    int err = posix_memalign(&ptr, alignment < sizeof(void*) ? sizeof(void*) : alignment, size);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    return ptr;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    if (is_bootstrap(ptr)) {
+        return bootstrap_size(ptr);
+    }
+    return my_malloc_usable_size(ptr);
+}
+
+// MYALLOC_TRACE=file records every allocation of the program (see
+// my_malloc_trace_start)
+__attribute__((constructor))
+static void start_trace(void) {
+    const char *path = getenv("MYALLOC_TRACE");
+    if (path && *path) {
+        in_allocator = 1;
+        my_malloc_trace_start(path);
+        in_allocator = 0;
+    }
+}
+
+// MYALLOC_GUARD_SAMPLE=n puts about one allocation in n in front of a guard
+// page, in a library built with -DHARDENED (see my_malloc_set_guard_sample)
+__attribute__((constructor))
+static void start_guard_sampling(void) {
+    const char *rate = getenv("MYALLOC_GUARD_SAMPLE");
+    if (rate && *rate) {
+        my_malloc_set_guard_sample((unsigned int)strtoul(rate, NULL, 10));
+    }
+}
+
+// MYALLOC_FASTBIN_LIMIT=bytes defers coalescing of small freed blocks (see
+// my_malloc_set_fastbin_limit)
+__attribute__((constructor))
+static void start_fastbins(void) {
+    const char *limit = getenv("MYALLOC_FASTBIN_LIMIT");
+    if (limit && *limit) {
+        my_malloc_set_fastbin_limit(strtoul(limit, NULL, 10));
+    }
+}
+
+// MYALLOC_STRATEGY=best, first or next picks the arenas' fit strategy (see
+// my_malloc_set_strategy)
+__attribute__((constructor))
+static void start_strategy(void) {
+    static const char *names[] = { "best", "first", "next" };
+    const char *name = getenv("MYALLOC_STRATEGY");
+    for (int i = 0; name && i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            my_malloc_set_strategy((fit_strategy_t)i);
+        }
+    }
+}
+
+// MYALLOC_HUGE_PAGES=1 backs the arenas with huge pages (see
+// my_malloc_set_huge_pages)
+__attribute__((constructor))
+static void start_huge_pages(void) {
+    const char *enable = getenv("MYALLOC_HUGE_PAGES");
+    if (enable && *enable) {
+        my_malloc_set_huge_pages(atoi(enable));
+    }
+}
+
+// MYALLOC_PROF=file profiles the program's heap and writes the profile when
+// it exits; MYALLOC_PROF_SAMPLE=bytes sets the sampling interval (see
+// my_malloc_prof_start)
+static const char *prof_path;
+
+static void dump_profile(void) {
+    in_allocator = 1;
+    my_malloc_prof_dump(prof_path);
+    in_allocator = 0;
+}
+
+__attribute__((constructor))
+static void start_profile(void) {
+    prof_path = getenv("MYALLOC_PROF");
+    if (prof_path && *prof_path) {
+        const char *sample = getenv("MYALLOC_PROF_SAMPLE");
+        in_allocator = 1;
+        int err = my_malloc_prof_start(sample ? strtoul(sample, NULL, 10) : 0);
+        in_allocator = 0;
+        if (!err) {
+            atexit(dump_profile);
+        }
+    }
+}
+
+EXPORT int malloc_trim(size_t pad) {
+    in_allocator = 1;
+    int released = my_malloc_trim(pad);
+    in_allocator = 0;
+    return released;
+}
@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "allocator.h"
+
+// ========== Regions ==========
+// A region hands out memory by bumping a cursor through chunks it takes
+// from the main heap with my_malloc. Objects are never freed one by one:
+// arena_reset rewinds the cursor to the start of the first chunk, and a
+// checkpoint rewinds it to wherever it was when the checkpoint was taken.
+// Chunks stay on the region's list after a rewind and are reused in order,
+// so both are O(1) and a region that has warmed up stops calling my_malloc.
+
+// Every object is aligned like max_align_t
+#define REGION_ALIGNMENT  16
+#define REGION_ALIGN(size) (((size) + (REGION_ALIGNMENT-1)) & ~(size_t)(REGION_ALIGNMENT-1))
+
+#define DEFAULT_REGION_CHUNK (64 * 1024)
+
+typedef struct region_chunk {
+    struct region_chunk *next;  // Chunks in the order they are used
+    size_t size;                // Usable bytes after the header
+    size_t used;                // Bytes handed out since the chunk was last rewound
+} region_chunk_t;
+
+#define REGION_CHUNK_HEADER REGION_ALIGN(sizeof(region_chunk_t))
+
+struct arena {
+    region_chunk_t *first;
+    region_chunk_t *current;    // Chunk the cursor is in (NULL until the first allocation)
+    size_t chunk_size;          // Usable size of a regular chunk
+};
+
+// ========== Helper Functions ==========
+
+// First byte of a chunk's data. Chunks are allocated REGION_ALIGNMENT-aligned
+// and the header is padded to it, so data offsets only need rounding up.
+static char *chunk_data(region_chunk_t *chunk) {
+    return (char*)chunk + REGION_CHUNK_HEADER;
+}
+
+// Get memory for a chunk holding at least `size` bytes from the main heap
+static region_chunk_t *new_chunk(size_t size) {
+    region_chunk_t *chunk = my_memalign(REGION_ALIGNMENT, REGION_CHUNK_HEADER + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+// Move the cursor to a chunk after the current one that can hold `size`
+// bytes: the next chunk on the list if it is big enough, otherwise a new
+// one linked in right after the current chunk
+static region_chunk_t *next_chunk(arena_t *arena, size_t size) {
+    region_chunk_t *current = arena->current;
+    region_chunk_t *next = current ? current->next : arena->first;
+
+    if (!next || next->size < size) {
+        region_chunk_t *chunk = new_chunk(size > arena->chunk_size ? size : arena->chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = next;
+        if (current) {
+            current->next = chunk;
+        } else {
+            arena->first = chunk;
+        }
+        next = chunk;
+    }
+
+    next->used = 0;
+    arena->current = next;
+    return next;
+}
+
+// ========== Public API ==========
+
+arena_t *arena_create(size_t chunk_size) {
+    arena_t *arena = my_malloc(sizeof(arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->chunk_size = chunk_size ? REGION_ALIGN(chunk_size) : DEFAULT_REGION_CHUNK;
+    return arena;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    if (size == 0 || size > SIZE_MAX - REGION_CHUNK_HEADER - REGION_ALIGNMENT) {
+        return NULL;
+    }
+
+    // Fast path: bump the cursor in the current chunk
+    region_chunk_t *chunk = arena->current;
+    if (chunk) {
+        size_t offset = REGION_ALIGN(chunk->used);
+        if (offset <= chunk->size && chunk->size - offset >= size) {
+            chunk->used = offset + size;
+            return chunk_data(chunk) + offset;
+        }
+    }
+
+    chunk = next_chunk(arena, size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->used = size;
+    return chunk_data(chunk);
+}
+
+void arena_reset(arena_t *arena) {
+    arena->current = NULL;
+}
+
+arena_checkpoint_t arena_save(arena_t *arena) {
+    arena_checkpoint_t checkpoint;
+    checkpoint.chunk = arena->current;
+    checkpoint.used = arena->current ? arena->current->used : 0;
+    return checkpoint;
+}
+
+void arena_restore(arena_t *arena, arena_checkpoint_t checkpoint) {
+    arena->current = checkpoint.chunk;
+    if (checkpoint.chunk) {
+        arena->current->used = checkpoint.used;
+    }
+}
+
+void arena_destroy(arena_t *arena) {
+    if (!arena) {
+        return;
+    }
+
+    region_chunk_t *chunk = arena->first;
+    while (chunk) {
+        region_chunk_t *next = chunk->next;
+        my_free(chunk);
+        chunk = next;
+    }
+    my_free(arena);
+}